@@ -28,6 +28,17 @@
 
 // #define RECOVERY_TEST
 
+// #define XPLINE_LAYOUT
+// #define LOCALITY_AWARE
+// #define READ_ONLY_ENTRIES
+// #define PREDICT_HOT_SET
+// #define TRICKLE_WRITE_BACK
+// #define NUMA_AGGREGATION
+// #define SHARED_SHIFT_THREAD
+// #define SWITCH_LOG               // print the decision of every window
+// #define FLUSH_RATE_MB 256        // pace the switch write-back
+// #define FLUSH_P99_TARGET_NS 4096 // and slow it down further above this p99
+
 #define WARMUP_FILE "/home/ljr/Nap/dataset/warmup"
 
 #include "index/cceh_NUMA.hpp"
@@ -28,7 +28,28 @@ struct CcehNapIndex {
     return ret.found;
   }
 
-  void del(const nap::Slice &key) {}
+  void del(const nap::Slice &key) {
+    map->erase((uint8_t *)key.data(), key.size());
+  }
+
+  // socket of the pool the key's KV buffer was allocated from
+  int numa_of(const nap::Slice &key) {
+    return index_numa_of(map->kv_of((uint8_t *)key.data(), key.size()));
+  }
+
+  // grouped by segment, so that each one is written while it is in cache
+  void batch_put(nap::KVBatch &kvs) {
+    std::vector<std::pair<size_t, size_t>> order(kvs.size());
+    for (size_t i = 0; i < kvs.size(); ++i) {
+      order[i] = {map->segment_of((uint8_t *)kvs[i].first.data(),
+                                  kvs[i].first.size()),
+                  i};
+    }
+    std::sort(order.begin(), order.end());
+    for (auto &o : order) {
+      put(kvs[o.second].first, kvs[o.second].second, true);
+    }
+  }
 };
 
 enum class cceh_op {
@@ -215,6 +236,34 @@ int main(int argc, char *argv[]) {
     nap::Topology::reset();
 
     cceh_nap.set_sampling_interval(32);
+#ifdef XPLINE_LAYOUT
+    cceh_nap.set_slot_layout(nap::SLOT_XPLINE_HOTNESS);
+#endif
+#ifdef LOCALITY_AWARE
+    cceh_nap.set_locality_aware(true);
+#endif
+#ifdef READ_ONLY_ENTRIES
+    cceh_nap.set_read_only_entries(true);
+#endif
+#ifdef PREDICT_HOT_SET
+    cceh_nap.set_prediction(true);
+#endif
+#ifdef TRICKLE_WRITE_BACK
+    cceh_nap.set_trickle_write_back(true);
+#endif
+#ifdef NUMA_AGGREGATION
+    cceh_nap.set_numa_aggregation(true);
+#endif
+#ifdef SWITCH_LOG
+    cceh_nap.set_switch_log(true);
+#endif
+#ifdef FLUSH_RATE_MB
+    cceh_nap.set_flush_rate(FLUSH_RATE_MB * 1024ull * 1024);
+#ifdef FLUSH_P99_TARGET_NS
+    cceh_nap.set_flush_latency_target(FLUSH_P99_TARGET_NS,
+                                      FLUSH_RATE_MB * 1024ull * 1024 / 8);
+#endif
+#endif
 #endif
     fclose(ycsb);
   }
@@ -67,7 +67,16 @@ struct ClevelNapIndex {
     return ret.found;
   }
 
-  void del(const nap::Slice &key) {}
+  void del(const nap::Slice &key) {
+    map->erase(persistent_map_type::key_type(key.ToString()),
+               my_thread_id + 1);
+  }
+
+  // socket of the pool the key's KV pair was allocated from
+  int numa_of(const nap::Slice &key) {
+    return index_numa_of(
+        map->kv_of(persistent_map_type::key_type(key.ToString())));
+  }
 };
 
 enum class clevel_op {
@@ -295,6 +304,34 @@ int main(int argc, char *argv[]) {
     nap::Topology::reset();
 
     clevel_nap.set_sampling_interval(32);
+#ifdef XPLINE_LAYOUT
+    clevel_nap.set_slot_layout(nap::SLOT_XPLINE_HOTNESS);
+#endif
+#ifdef LOCALITY_AWARE
+    clevel_nap.set_locality_aware(true);
+#endif
+#ifdef READ_ONLY_ENTRIES
+    clevel_nap.set_read_only_entries(true);
+#endif
+#ifdef PREDICT_HOT_SET
+    clevel_nap.set_prediction(true);
+#endif
+#ifdef TRICKLE_WRITE_BACK
+    clevel_nap.set_trickle_write_back(true);
+#endif
+#ifdef NUMA_AGGREGATION
+    clevel_nap.set_numa_aggregation(true);
+#endif
+#ifdef SWITCH_LOG
+    clevel_nap.set_switch_log(true);
+#endif
+#ifdef FLUSH_RATE_MB
+    clevel_nap.set_flush_rate(FLUSH_RATE_MB * 1024ull * 1024);
+#ifdef FLUSH_P99_TARGET_NS
+    clevel_nap.set_flush_latency_target(FLUSH_P99_TARGET_NS,
+                                        FLUSH_RATE_MB * 1024ull * 1024 / 8);
+#endif
+#endif
 #endif
     fclose(ycsb);
   }
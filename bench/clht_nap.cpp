@@ -78,7 +78,27 @@ struct ClhtNapIndex {
     return ret.found;
   }
 
-  void del(const nap::Slice &key) {}
+  void del(const nap::Slice &key) {
+    map->erase(persistent_map_type::key_type(key.ToString()));
+  }
+
+  // socket of the pool the key's KV pair was allocated from
+  int numa_of(const nap::Slice &key) {
+    return index_numa_of(
+        map->kv_of(persistent_map_type::key_type(key.ToString())));
+  }
+
+  // grouped by bucket, so that each one is locked and written once in a row
+  void batch_put(nap::KVBatch &kvs) {
+    std::vector<std::pair<size_t, size_t>> order(kvs.size());
+    for (size_t i = 0; i < kvs.size(); ++i) {
+      order[i] = {map->bucket_of(kvs[i].first.ToString()), i};
+    }
+    std::sort(order.begin(), order.end());
+    for (auto &o : order) {
+      put(kvs[o.second].first, kvs[o.second].second, true);
+    }
+  }
 };
 
 enum class clht_op {
@@ -284,6 +304,34 @@ int main(int argc, char *argv[]) {
     nap::Topology::reset();
 
     clht_nap.set_sampling_interval(32);
+#ifdef XPLINE_LAYOUT
+    clht_nap.set_slot_layout(nap::SLOT_XPLINE_HOTNESS);
+#endif
+#ifdef LOCALITY_AWARE
+    clht_nap.set_locality_aware(true);
+#endif
+#ifdef READ_ONLY_ENTRIES
+    clht_nap.set_read_only_entries(true);
+#endif
+#ifdef PREDICT_HOT_SET
+    clht_nap.set_prediction(true);
+#endif
+#ifdef TRICKLE_WRITE_BACK
+    clht_nap.set_trickle_write_back(true);
+#endif
+#ifdef NUMA_AGGREGATION
+    clht_nap.set_numa_aggregation(true);
+#endif
+#ifdef SWITCH_LOG
+    clht_nap.set_switch_log(true);
+#endif
+#ifdef FLUSH_RATE_MB
+    clht_nap.set_flush_rate(FLUSH_RATE_MB * 1024ull * 1024);
+#ifdef FLUSH_P99_TARGET_NS
+    clht_nap.set_flush_latency_target(FLUSH_P99_TARGET_NS,
+                                      FLUSH_RATE_MB * 1024ull * 1024 / 8);
+#endif
+#endif
 #endif
     fclose(ycsb);
   }
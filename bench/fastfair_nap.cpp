@@ -26,6 +26,26 @@ struct FastFairTreeIndex {
   }
 
   void del(const nap::Slice &key) {}
+
+  // socket of the pool the key's leaf was allocated from
+  int numa_of(const nap::Slice &key) {
+    return index_numa_of(map->btree_search_leaf((char *)key.data()));
+  }
+
+  // sorted, so that each key starts from the leaf of the previous one
+  void batch_put(nap::KVBatch &kvs) {
+    std::sort(kvs.begin(), kvs.end(),
+              [](const std::pair<nap::Slice, nap::Slice> &a,
+                 const std::pair<nap::Slice, nap::Slice> &b) {
+                return a.first.compare(b.first) < 0;
+              });
+    std::vector<char *> keys(kvs.size()), values(kvs.size());
+    for (size_t i = 0; i < kvs.size(); ++i) {
+      keys[i] = (char *)kvs[i].first.data();
+      values[i] = (char *)(cur_value++);
+    }
+    map->btree_insert_sorted(keys.data(), values.data(), kvs.size());
+  }
 };
 
 enum class cceh_op { UNKNOWN, INSERT, READ, MAX_OP };
@@ -206,6 +226,34 @@ int main(int argc, char *argv[]) {
     nap::Topology::reset();
 
     fastfair_nap.set_sampling_interval(32);
+#ifdef XPLINE_LAYOUT
+    fastfair_nap.set_slot_layout(nap::SLOT_XPLINE_HOTNESS);
+#endif
+#ifdef LOCALITY_AWARE
+    fastfair_nap.set_locality_aware(true);
+#endif
+#ifdef READ_ONLY_ENTRIES
+    fastfair_nap.set_read_only_entries(true);
+#endif
+#ifdef PREDICT_HOT_SET
+    fastfair_nap.set_prediction(true);
+#endif
+#ifdef TRICKLE_WRITE_BACK
+    fastfair_nap.set_trickle_write_back(true);
+#endif
+#ifdef NUMA_AGGREGATION
+    fastfair_nap.set_numa_aggregation(true);
+#endif
+#ifdef SWITCH_LOG
+    fastfair_nap.set_switch_log(true);
+#endif
+#ifdef FLUSH_RATE_MB
+    fastfair_nap.set_flush_rate(FLUSH_RATE_MB * 1024ull * 1024);
+#ifdef FLUSH_P99_TARGET_NS
+    fastfair_nap.set_flush_latency_target(FLUSH_P99_TARGET_NS,
+                                          FLUSH_RATE_MB * 1024ull * 1024 / 8);
+#endif
+#endif
 #endif
     fclose(ycsb);
   }
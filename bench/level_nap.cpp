@@ -70,7 +70,9 @@ struct LevelNapIndex {
     return ret.found;
   }
 
-  void del(const nap::Slice &key) {}
+  void del(const nap::Slice &key) {
+    map->erase(persistent_map_type::key_type(key.ToString()), my_thread_id);
+  }
 };
 
 enum class level_hash_op {
@@ -280,6 +282,34 @@ int main(int argc, char *argv[]) {
     nap::Topology::reset();
 
     level_nap.set_sampling_interval(32);
+#ifdef XPLINE_LAYOUT
+    level_nap.set_slot_layout(nap::SLOT_XPLINE_HOTNESS);
+#endif
+#ifdef LOCALITY_AWARE
+    level_nap.set_locality_aware(true);
+#endif
+#ifdef READ_ONLY_ENTRIES
+    level_nap.set_read_only_entries(true);
+#endif
+#ifdef PREDICT_HOT_SET
+    level_nap.set_prediction(true);
+#endif
+#ifdef TRICKLE_WRITE_BACK
+    level_nap.set_trickle_write_back(true);
+#endif
+#ifdef NUMA_AGGREGATION
+    level_nap.set_numa_aggregation(true);
+#endif
+#ifdef SWITCH_LOG
+    level_nap.set_switch_log(true);
+#endif
+#ifdef FLUSH_RATE_MB
+    level_nap.set_flush_rate(FLUSH_RATE_MB * 1024ull * 1024);
+#ifdef FLUSH_P99_TARGET_NS
+    level_nap.set_flush_latency_target(FLUSH_P99_TARGET_NS,
+                                       FLUSH_RATE_MB * 1024ull * 1024 / 8);
+#endif
+#endif
 #endif
     fclose(ycsb);
   }
@@ -19,6 +19,26 @@ struct MassTreeIndex {
   }
 
   void del(const nap::Slice &key) {}
+
+  // socket of the pool the key's leafvalue was allocated from
+  int numa_of(const nap::Slice &key) {
+    auto t = map->getThreadInfo();
+    return index_numa_of(map->get_leafvalue(key.data(), t));
+  }
+
+  // sorted, so that each key starts from the leaf of the previous one
+  void batch_put(nap::KVBatch &kvs) {
+    std::sort(kvs.begin(), kvs.end(),
+              [](const std::pair<nap::Slice, nap::Slice> &a,
+                 const std::pair<nap::Slice, nap::Slice> &b) {
+                return a.first.compare(b.first) < 0;
+              });
+    auto t = map->getThreadInfo();
+    masstree::leafnode *leaf = nullptr;
+    for (auto &kv : kvs) {
+      map->put(kv.first.data(), cur_value++, t, &leaf);
+    }
+  }
 };
 
 enum class cceh_op { UNKNOWN, INSERT, READ, MAX_OP };
@@ -205,6 +225,34 @@ int main(int argc, char *argv[]) {
     nap::Topology::reset();
 
     masstree_nap.set_sampling_interval(32);
+#ifdef XPLINE_LAYOUT
+    masstree_nap.set_slot_layout(nap::SLOT_XPLINE_HOTNESS);
+#endif
+#ifdef LOCALITY_AWARE
+    masstree_nap.set_locality_aware(true);
+#endif
+#ifdef READ_ONLY_ENTRIES
+    masstree_nap.set_read_only_entries(true);
+#endif
+#ifdef PREDICT_HOT_SET
+    masstree_nap.set_prediction(true);
+#endif
+#ifdef TRICKLE_WRITE_BACK
+    masstree_nap.set_trickle_write_back(true);
+#endif
+#ifdef NUMA_AGGREGATION
+    masstree_nap.set_numa_aggregation(true);
+#endif
+#ifdef SWITCH_LOG
+    masstree_nap.set_switch_log(true);
+#endif
+#ifdef FLUSH_RATE_MB
+    masstree_nap.set_flush_rate(FLUSH_RATE_MB * 1024ull * 1024);
+#ifdef FLUSH_P99_TARGET_NS
+    masstree_nap.set_flush_latency_target(FLUSH_P99_TARGET_NS,
+                                          FLUSH_RATE_MB * 1024ull * 1024 / 8);
+#endif
+#endif
 #endif
     fclose(ycsb);
   }
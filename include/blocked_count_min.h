@@ -0,0 +1,227 @@
+#if !defined(_BLOCKED_COUNT_MIN_H_)
+#define _BLOCKED_COUNT_MIN_H_
+
+#include "hot_set_detector.h"
+#include "nap_common.h"
+#include "slice.h"
+#include "top_k.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+#include <vector>
+
+namespace nap {
+
+// Count-min sketch whose rows of a key share one cache line: the key's
+// fingerprint picks a block of 16 counters and one counter of it per row,
+// so a sample costs one hash and one cache miss, and the same fingerprint
+// looks the key up in the heap. Conservative update raises the key's
+// counters only as far as their minimum plus the new samples, which keeps
+// collisions from inflating the counts of heavy hitters.
+//
+// A batch hashes all its keys and prefetches their blocks before updating
+// any. Counters decay by half per window like CountMin's, with one tag per
+// block, so a stale block is aged with a single vector shift when touched.
+// Whether a key was sampled in the current window is told by its block's
+// tag as well, which any key of the block refreshes.
+// Like CountMin's, a detector without rings notes the blocks it touches in
+// a window, and only those are merged and cleared.
+class BlockedCountMin : public HotSetDetector {
+public:
+  BlockedCountMin(int hot_keys_cnt, bool with_rings = true)
+      : HotSetDetector(with_rings), topK(hot_keys_cnt) {
+    blocks = (Block *)aligned_alloc(kCachelineSize, kBlockCnt * sizeof(Block));
+    memset(blocks, 0, kBlockCnt * sizeof(Block));
+    tags = new uint8_t[kBlockCnt]();
+    if (!with_rings) {
+      dirty = new uint8_t[kBlockCnt]();
+    }
+  }
+
+  ~BlockedCountMin() override {
+    free(blocks);
+    delete[] tags;
+    delete[] dirty;
+  }
+
+  std::vector<Node> &get_list() override { return topK.get_list(); }
+
+  void set_candidates(int k) override { topK.set_capacity(k); }
+
+  void reset() override {
+    topK.reset();
+
+    // aged to the ending window, so that the tags stay those of a write
+    size_t end = std::min(sweep_cursor + kBlockCnt / kSweepWindows, kBlockCnt);
+    for (size_t b = sweep_cursor; b < end; ++b) {
+      age(b);
+    }
+    sweep_cursor = end == kBlockCnt ? 0 : end;
+    window++;
+  }
+
+  uint32_t query(const Slice &key) override {
+    auto fp = key_fingerprint(key);
+    size_t b = fp & (kBlockCnt - 1);
+    uint32_t shift = (uint8_t)(window - tags[b]);
+
+    uint32_t min_freq = UINT32_MAX;
+    for (int r = 0; r < kRows; ++r) {
+      min_freq = std::min(min_freq, blocks[b].cnt[lane(fp, r)]);
+    }
+    return shift >= 32 ? 0 : min_freq >> shift;
+  }
+
+  bool sampled_in_window(const Slice &key) override {
+    auto fp = key_fingerprint(key);
+    size_t b = fp & (kBlockCnt - 1);
+    return tags[b] == window && query(key) != 0;
+  }
+
+  void merge(HotSetDetector &o) override {
+    auto &other = static_cast<BlockedCountMin &>(o);
+    for (auto b : other.touched) {
+      age(b);
+      other.age(b);
+      for (int i = 0; i < kLanes; ++i) {
+        blocks[b].cnt[i] += other.blocks[b].cnt[i];
+      }
+      memset(&other.blocks[b], 0, sizeof(Block));
+      other.dirty[b] = 0;
+    }
+    other.touched.clear();
+
+    topK.recount([this](const Node &n) { return query(n.key); });
+    auto &l = other.get_list();
+    for (size_t i = 1; i < l.size(); ++i) {
+      topK.merge(l[i], query(l[i].key));
+    }
+  }
+
+  void access(const SampledAccess &a) override { access_batch(&a, 1); }
+
+  void access_batch(const SampledAccess *batch, size_t n) override {
+    uint64_t fp[kMaxBatch];
+
+    for (size_t i = 0; i < n; i += kMaxBatch) {
+      size_t cnt = std::min(n - i, kMaxBatch);
+      for (size_t j = 0; j < cnt; ++j) {
+        fp[j] = key_fingerprint(batch[i + j].key);
+        __builtin_prefetch(&blocks[fp[j] & (kBlockCnt - 1)], 1);
+      }
+      for (size_t j = 0; j < cnt; ++j) {
+        auto &a = batch[i + j];
+        topK.access_a_key(a.key, fp[j], update(fp[j], a.cnt), a.writes, a.numa,
+                          a.cnt);
+      }
+    }
+  }
+
+private:
+  constexpr static size_t kBlockCnt = 1ull << 18; // 16MB of counters
+  constexpr static int kRows = 4;
+  constexpr static int kLanes = 16; // counters per block
+  constexpr static int kSweepWindows = 64;
+  constexpr static size_t kMaxBatch = 16;
+
+  struct alignas(kCachelineSize) Block {
+    uint32_t cnt[kLanes];
+  };
+
+  static_assert(sizeof(Block) == kCachelineSize, "XX");
+
+  // the counter of row ``r``, from the bits above the block index. Rows may
+  // share a counter, which is then incremented once.
+  static int lane(uint64_t fp, int r) { return (fp >> (32 + 4 * r)) & 15; }
+
+  // halve the counters of block ``b`` once per window since it was tagged
+  void age(size_t b) {
+    uint32_t shift = (uint8_t)(window - tags[b]);
+    if (shift == 0) {
+      return;
+    }
+    tags[b] = window;
+
+    auto &blk = blocks[b];
+#ifdef __AVX2__
+    __m128i s = _mm_cvtsi32_si128(shift); // zeroes the lanes from 32 on
+    auto *v = (__m256i *)blk.cnt;
+    _mm256_store_si256(v, _mm256_srl_epi32(_mm256_load_si256(v), s));
+    _mm256_store_si256(v + 1, _mm256_srl_epi32(_mm256_load_si256(v + 1), s));
+#else
+    for (int i = 0; i < kLanes; ++i) {
+      blk.cnt[i] = shift >= 32 ? 0 : blk.cnt[i] >> shift;
+    }
+#endif
+  }
+
+  // conservative update of the key by ``cnt``, return its new estimate
+  uint32_t update(uint64_t fp, uint32_t cnt) {
+    size_t b = fp & (kBlockCnt - 1);
+    age(b);
+    if (dirty && !dirty[b]) {
+      dirty[b] = 1;
+      touched.push_back(b);
+    }
+    auto &blk = blocks[b];
+
+    uint32_t rows = 0; // lanes of the key
+    for (int r = 0; r < kRows; ++r) {
+      rows |= 1u << lane(fp, r);
+    }
+
+#ifdef __AVX2__
+    auto *v = (__m256i *)blk.cnt;
+    __m256i lo = _mm256_load_si256(v);
+    __m256i hi = _mm256_load_si256(v + 1);
+
+    const __m256i bit_lo = _mm256_setr_epi32(1 << 0, 1 << 1, 1 << 2, 1 << 3,
+                                             1 << 4, 1 << 5, 1 << 6, 1 << 7);
+    const __m256i bit_hi = _mm256_slli_epi32(bit_lo, 8);
+    __m256i mask = _mm256_set1_epi32(rows);
+    __m256i sel_lo = _mm256_cmpeq_epi32(_mm256_and_si256(mask, bit_lo), bit_lo);
+    __m256i sel_hi = _mm256_cmpeq_epi32(_mm256_and_si256(mask, bit_hi), bit_hi);
+
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i m = _mm256_min_epu32(_mm256_blendv_epi8(ones, lo, sel_lo),
+                                 _mm256_blendv_epi8(ones, hi, sel_hi));
+    m = _mm256_min_epu32(m, _mm256_permute2x128_si256(m, m, 1));
+    m = _mm256_min_epu32(m, _mm256_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_epu32(m, _mm256_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t freq = _mm256_cvtsi256_si32(m) + cnt;
+
+    // the selected lanes are raised to at least ``freq``
+    m = _mm256_set1_epi32(freq);
+    lo = _mm256_blendv_epi8(lo, _mm256_max_epu32(lo, m), sel_lo);
+    hi = _mm256_blendv_epi8(hi, _mm256_max_epu32(hi, m), sel_hi);
+    _mm256_store_si256(v, lo);
+    _mm256_store_si256(v + 1, hi);
+#else
+    uint32_t min_freq = UINT32_MAX;
+    for (uint32_t bits = rows; bits; bits &= bits - 1) {
+      min_freq = std::min(min_freq, blk.cnt[__builtin_ctz(bits)]);
+    }
+    uint32_t freq = min_freq + cnt;
+    for (uint32_t bits = rows; bits; bits &= bits - 1) {
+      auto &c = blk.cnt[__builtin_ctz(bits)];
+      c = std::max(c, freq);
+    }
+#endif
+    return freq;
+  }
+
+  Block *blocks;
+  uint8_t *tags;                 // window each block was last aged in
+  uint8_t *dirty{nullptr};       // without rings: block is in ``touched``
+  std::vector<uint32_t> touched; // blocks written since the last merge
+  uint8_t window{0};
+  size_t sweep_cursor{0};
+
+  TopK topK;
+};
+
+} // namespace nap
+
+#endif // _BLOCKED_COUNT_MIN_H_
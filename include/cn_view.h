@@ -1,6 +1,7 @@
 #if !defined(_CN_VIEW_H_)
 #define _CN_VIEW_H_
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <unordered_map>
@@ -9,6 +10,7 @@
 #include "nap_common.h"
 #include "rw_lock.h"
 #include "slice.h"
+#include "version_clock.h"
 
 namespace nap {
 
@@ -22,7 +24,8 @@ public:
     WRLock l; // control concurrent accesses to the NAL
     bool is_deleted;
     bool shifting;
-    int sp_view_index;
+    int sp_view_index; // -1: DRAM-only, no PC-view slot (yet)
+    int key_index;     // of the key in the PC-view
 
 
     // used for 3-phase switch for lazy initialization
@@ -30,30 +33,35 @@ public:
     
     // serve lookup operation
     std::string v;
-    
-#ifndef GLOBAL_VERSION
+
+    // newest record in the log-structured NAL
+    char *nal_ptr;
+
     uint64_t version; // for recoverability
-#endif
 
     Entry()
-        : is_deleted(false), shifting(false), sp_view_index(0),
-          location(WhereIsData::IN_RAW_INDEX) {
-#ifndef GLOBAL_VERSION
-      version = 0;
-#endif
-    }
+        : is_deleted(false), shifting(false), sp_view_index(0), key_index(0),
+          location(WhereIsData::IN_RAW_INDEX), nal_ptr(nullptr), version(0) {}
 
-#ifndef GLOBAL_VERSION
-    uint64_t next_version() { return version++; }
+    // ``clock`` is the one of the Nap instance
+#ifdef GLOBAL_VERSION
+    uint64_t next_version(VersionClock &clock) {
+      return version = clock.tick(version);
+    }
+#else
+    uint64_t next_version(VersionClock &) { return version++; }
 #endif
   };
 
   CNView() {}
 
-  CNView(const std::vector<std::pair<std::string, WhereIsData>> &list) {
+  // keys [slot_cnt, list.size()) start as DRAM-only entries
+  CNView(const std::vector<std::pair<std::string, WhereIsData>> &list,
+         size_t slot_cnt) {
     for (size_t i = 0; i < list.size(); ++i) {
       Entry e;
-      e.sp_view_index = i;
+      e.sp_view_index = i < slot_cnt ? (int)i : -1;
+      e.key_index = i;
       e.location = list[i].second;
       view[list[i].first] = std::move(e);
     }
@@ -80,6 +88,7 @@ public:
           auto &old_e = old_view->view[e.first];
           e.second.v = old_e.v;
           e.second.is_deleted = old_e.is_deleted;
+          e.second.version = std::max(e.second.version, old_e.version);
         }
         e.second.l.wUnlock();
       }
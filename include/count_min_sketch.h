@@ -2,6 +2,7 @@
 #define _COUNT_MIN_SKETCH_H_
 
 #include "hash32.h"
+#include "hot_set_detector.h"
 #include "murmur_hash2.h"
 #include "nap_common.h"
 #include "slice.h"
@@ -14,6 +15,7 @@
 #include <set>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 // insert <k, freq>;
 // if (k in set) { // Hashtable O(1)
@@ -37,143 +39,130 @@ inline unsigned long __hash(const char *str, int size) {
 
 namespace nap {
 
-struct __attribute__((__packed__)) PerRecord {
-  uint64_t timestamp;
-  char *v;
-
-  PerRecord() : timestamp(0), v(nullptr) {}
-};
-
-struct RecordCursor {
-  uint64_t last_ts;
-  uint32_t last_index;
-
-  RecordCursor() : last_ts(0), last_index(0) {}
-};
-
-static_assert(sizeof(PerRecord) == 16, "XX");
-
-class CountMin {
+// count-min sketch plus a min heap of its top keys. Counters decay by half
+// every window instead of being cleared: each one is tagged with the window
+// it was last written in and aged lazily when it is touched, so a reset is
+// O(1) for the sketch and keys that stay hot enter the heap with their
+// history. A slice of the sketch is re-tagged at every reset, so that no
+// tag is older than kSweepWindows and the 8-bit tags never wrap. The
+// decay stands in for a sliding window: the candidates of a window rank
+// by their recent samples plus a geometric tail of the older ones, in one
+// counter instead of one per window of the slide. A key was sampled in
+// the current window only if all its counters carry its tag.
+//
+// A detector without rings holds the samples of one window only: it notes
+// the counters it raises from zero, and ``merge`` moves just those into
+// the detector it is merged into and clears them.
+class CountMin : public HotSetDetector {
 private:
   int hot_keys_cnt;
 
   const static int kHashCnt = 3;
   const static int kBloomLength = 876199;
-  uint32_t *bloom_array[kHashCnt];
+  uint32_t *bloom_array[kHashCnt]; // | window tag (8) | count (24) |
   uint64_t hash_seed[32] = {931901, 1974701, 7296907};
 
+  constexpr static int kCountBits = 24;
+  constexpr static uint32_t kCountMask = (1u << kCountBits) - 1;
+  constexpr static int kSweepWindows = 64;
+
+  uint8_t window{0};
+  size_t sweep_cursor{0};
+
+  bool track;                              // without rings
+  std::vector<uint32_t> touched[kHashCnt]; // counters raised from zero
+
   TopK topK;
 
-  const uint32_t kRecordBufferSize = 20000;
-  PerRecord *record_buffer[kMaxThreadCnt];
-  RecordCursor cursors[kMaxThreadCnt];
+  uint32_t decayed(uint32_t c) const {
+    uint32_t age = (uint8_t)(window - (c >> kCountBits));
+    return age >= kCountBits ? 0 : (c & kCountMask) >> age;
+  }
+
+  uint32_t tagged(uint32_t cnt) const {
+    return ((uint32_t)window << kCountBits) | std::min(cnt, kCountMask);
+  }
 
 public:
-  CountMin(int hot_keys_cnt) : hot_keys_cnt(hot_keys_cnt), topK(hot_keys_cnt) {
+  CountMin(int hot_keys_cnt, bool with_rings = true)
+      : HotSetDetector(with_rings), hot_keys_cnt(hot_keys_cnt),
+        track(!with_rings), topK(hot_keys_cnt) {
     for (int i = 0; i < kHashCnt; ++i) {
       bloom_array[i] = new uint32_t[kBloomLength];
       memset(bloom_array[i], 0, kBloomLength * sizeof(uint32_t));
     }
-
-    for (int i = 0; i < kMaxThreadCnt; ++i) {
-      record_buffer[i] = new PerRecord[kRecordBufferSize];
-    }
   }
 
-  ~CountMin() {
+  ~CountMin() override {
     for (int i = 0; i < kHashCnt; ++i) {
       if (bloom_array[i]) {
         delete[] bloom_array[i];
       }
     }
-
-    for (int i = 0; i < kMaxThreadCnt; ++i) {
-      if (record_buffer[i]) {
-        delete[] record_buffer[i];
-      }
-    }
   }
 
-  std::vector<Node> &get_list() { return topK.get_list(); }
+  std::vector<Node> &get_list() override { return topK.get_list(); }
+
+  void set_candidates(int k) override { topK.set_capacity(k); }
 
-  void reset() {
+  void reset() override {
     topK.reset();
+
+    // aged to the ending window, so that the tags stay those of a write
+    size_t end = std::min(sweep_cursor + kBloomLength / kSweepWindows + 1,
+                          (size_t)kBloomLength);
     for (int i = 0; i < kHashCnt; ++i) {
-      memset(bloom_array[i], 0, kBloomLength * sizeof(uint32_t));
+      for (size_t j = sweep_cursor; j < end; ++j) {
+        bloom_array[i][j] = tagged(decayed(bloom_array[i][j]));
+      }
     }
+    sweep_cursor = end == (size_t)kBloomLength ? 0 : end;
+    window++;
   }
 
-  void record(const Slice &key) {
-
-    // for threads that access keys.
-    static thread_local int index = 0;
-    static thread_local char *free_buffer = nullptr;
-    static thread_local PerRecord *thread_records =
-        record_buffer[Topology::threadID()];
-
-    char *buf;
-    if (free_buffer && *(uint32_t *)(free_buffer) >= key.size()) {
-      buf = free_buffer;
-      free_buffer = nullptr;
-    } else {
-      buf = (char *)malloc(key.size() + sizeof(uint32_t));
+  uint32_t query(const Slice &key) override {
+    uint32_t min_freq = UINT32_MAX;
+    for (int i = 0; i < kHashCnt; ++i) {
+      auto h =
+          MurmurHash64A(key.data(), key.size(), hash_seed[i]) % kBloomLength;
+      min_freq = std::min(min_freq, decayed(bloom_array[i][h]));
     }
+    return min_freq;
+  }
 
-    *(uint32_t *)buf = key.size();
-    memcpy(buf + sizeof(uint32_t), key.data(), key.size());
-
-    char *old_ptr = thread_records[index].v;
-    
-
-    // record access pattern (key, timestamp), it is coordination-free
-    thread_records[index].v = buf;
-    thread_records[index].timestamp = asm_rdtsc();
-
-    if (!old_ptr) {
-      if (!free_buffer) {
-        free_buffer = old_ptr;
-      } else if (*(uint32_t *)(free_buffer) < *(uint32_t *)(old_ptr)) {
-        free(free_buffer);
-        free_buffer = old_ptr;
+  bool sampled_in_window(const Slice &key) override {
+    for (int i = 0; i < kHashCnt; ++i) {
+      auto h =
+          MurmurHash64A(key.data(), key.size(), hash_seed[i]) % kBloomLength;
+      auto c = bloom_array[i][h];
+      if ((uint8_t)(c >> kCountBits) != window || (c & kCountMask) == 0) {
+        return false;
       }
     }
-
-    index = (index + 1) % kRecordBufferSize;
+    return true;
   }
 
-  void poll_workloads(double seconds) {
-
-    uint64_t ns = seconds * (1000ull * 1000 * 1000);
-    uint16_t kBatchPerThread = 8;
-    Timer timer;
-    timer.begin();
-
-    while (true) {
-      for (int i = 0; i < kMaxThreadCnt; ++i) {
-        for (int k = 0; k < kBatchPerThread; ++k) {
-          auto &c = cursors[i];
-          auto &r = record_buffer[i][c.last_index];
-          if (r.timestamp < c.last_ts ||
-              r.v == nullptr) {
-            break; // invalid record
-          }
-           
-
-          // update count-min sketch and min heap
-          this->access_a_key(Slice(r.v + sizeof(uint32_t), *(uint32_t *)r.v));
-
-          c.last_ts = r.timestamp;
-          c.last_index = (c.last_index + 1) % kRecordBufferSize;
-        }
-
-        if (timer.end() > ns) {
-          return;
-        }
+  void merge(HotSetDetector &o) override {
+    auto &other = static_cast<CountMin &>(o);
+    for (int i = 0; i < kHashCnt; ++i) {
+      for (auto j : other.touched[i]) {
+        auto &c = other.bloom_array[i][j];
+        bloom_array[i][j] =
+            tagged(decayed(bloom_array[i][j]) + other.decayed(c));
+        c = 0;
       }
+      other.touched[i].clear();
+    }
+
+    topK.recount([this](const Node &n) { return query(n.key); });
+    auto &l = other.get_list();
+    for (size_t i = 1; i < l.size(); ++i) {
+      topK.merge(l[i], query(l[i].key));
     }
   }
 
-  void access_a_key(const Slice &key) {
+  void access(const SampledAccess &a) override {
+    auto &key = a.key;
 
     // static std::hash<std::string> hash_fn;
     uint64_t hash_val[kHashCnt];
@@ -184,15 +173,21 @@ public:
     // hash_val[1] =__hash(key.c_str(), key.size()) % kBloomLength;
     // hash_val[2] = xxhash(key.c_str(), key.size(), 333) % kBloomLength;
 
-    uint64_t min_freq = ++bloom_array[0][hash_val[0]];
-
-    for (int i = 1; i < kHashCnt; ++i) {
-      auto tmp = ++bloom_array[i][hash_val[i]];
+    uint64_t min_freq = UINT64_MAX;
+    for (int i = 0; i < kHashCnt; ++i) {
+      auto &c = bloom_array[i][hash_val[i]];
+      auto old = decayed(c);
+      if (track && old == 0) {
+        touched[i].push_back(hash_val[i]);
+      }
+      auto tmp = old + a.cnt;
+      c = tagged(tmp);
       if (tmp < min_freq) {
         min_freq = tmp;
       }
     }
-    topK.access_a_key(key.ToString(), min_freq);
+    topK.access_a_key(key, key_fingerprint(key), min_freq, a.writes, a.numa,
+                      a.cnt);
   }
 };
 
@@ -3,12 +3,15 @@
 
 #include "nap_common.h"
 #include "nvm.h"
+#include "rw_lock.h"
 #include "topology.h"
 
 #include <bitset>
 #include <cassert>
 #include <cstdio>
 #include <list>
+#include <map>
+#include <vector>
 
 namespace nap {
 
@@ -38,28 +41,32 @@ struct SlabPage {
   uint64_t cls;
   uint64_t bitmap_1;
   uint64_t bitmap_2;
+  uint32_t owner;      // index of the BlockManager the page belongs to
+  uint32_t evacuating; // set by the compactor, live values are moved out
 
-  SlabPage(uint8_t cls) : cls(cls) {
+  SlabPage(uint8_t cls, uint32_t owner)
+      : cls(cls), owner(owner), evacuating(0) {
 
     // the first slab is header.
     bitmap_1 = 0x1;
     bitmap_2 = 0x0;
   }
 
+  // only the owner thread allocates, but any thread may free concurrently.
   char *alloc(bool &need_del) {
 
     int pos = -1;
     if (cls == _64_B && bitmap_1 == limit::k64All) {
       pos = __builtin_ffsll(~bitmap_2) - 1;
-      bitmap_2 |= 1ull << pos;
-      need_del = (bitmap_1 == limit::k64All) && (bitmap_2 == limit::k64All);
+      auto b = __atomic_or_fetch(&bitmap_2, 1ull << pos, __ATOMIC_ACQ_REL);
+      need_del = (bitmap_1 == limit::k64All) && (b == limit::k64All);
 
       pos += 64;
     } else {
 
       pos = __builtin_ffsll(~bitmap_1) - 1;
-      bitmap_1 |= 1ull << pos;
-      need_del = bitmap_1 == kFullArray[cls];
+      auto b = __atomic_or_fetch(&bitmap_1, 1ull << pos, __ATOMIC_ACQ_REL);
+      need_del = b == kFullArray[cls];
     }
 
     assert(pos != -1);
@@ -67,8 +74,12 @@ struct SlabPage {
     return (char *)this + pos * kSlabSizes[cls];
   }
 
+  static SlabPage *page_of(void *addr) {
+    return (SlabPage *)((uint64_t)addr & (~(kPageSize - 1)));
+  }
+
   static void free(char *addr) {
-    SlabPage *page = (SlabPage *)((uint64_t)addr & (~(kPageSize - 1)));
+    SlabPage *page = page_of(addr);
     size_t offset = (uint64_t)addr & (kPageSize - 1);
 
     int pos = offset / kSlabSizes[page->cls];
@@ -76,21 +87,35 @@ struct SlabPage {
     assert(pos != 0);
     if (pos >= 64) {
       assert(page->cls == _64_B);
-      page->bitmap_2 &= ~(1ull << (pos - 64)); // clear
+      __atomic_and_fetch(&page->bitmap_2, ~(1ull << (pos - 64)),
+                         __ATOMIC_ACQ_REL); // clear
     } else {
-      page->bitmap_1 &= ~(1ull << pos); // clear
+      __atomic_and_fetch(&page->bitmap_1, ~(1ull << pos),
+                         __ATOMIC_ACQ_REL); // clear
     }
   }
 
-} __attribute__((packed));
+  int capacity() const { return kPageSize / kSlabSizes[cls] - 1; }
+
+  int live() const {
+    return __builtin_popcountll(__atomic_load_n(&bitmap_1, __ATOMIC_ACQUIRE)) +
+           __builtin_popcountll(__atomic_load_n(&bitmap_2, __ATOMIC_ACQUIRE)) -
+           1;
+  }
+
+  bool is_empty() const { return live() == 0; }
 
+} __attribute__((packed));
 static_assert(sizeof(SlabPage) < 64, "XXX");
 
 struct BlockMeta {
   char *block_addr;
+  PMEMoid oid;
   uint64_t bitmap[2];
 
-  BlockMeta(char *addr) : block_addr(addr) { bitmap[0] = bitmap[1] = 0x0; }
+  BlockMeta(char *addr, PMEMoid oid) : block_addr(addr), oid(oid) {
+    bitmap[0] = bitmap[1] = 0x0;
+  }
 
   char *get_new_page(bool &is_del) {
     int pos = -1;
@@ -105,10 +130,25 @@ struct BlockMeta {
     }
     assert(pos != -1);
 
-    is_del = (bitmap[0] == limit::k64All) && (bitmap[1] == limit::k64All);
+    is_del = is_full();
 
     return block_addr + pos * kPageSize;
   }
+
+  void put_page(char *page) {
+    int pos = (page - block_addr) / kPageSize;
+    bitmap[pos / 64] &= ~(1ull << (pos % 64));
+  }
+
+  bool contains(char *addr) const {
+    return addr >= block_addr && addr < block_addr + kBlockSize;
+  }
+
+  bool is_full() const {
+    return (bitmap[0] == limit::k64All) && (bitmap[1] == limit::k64All);
+  }
+
+  bool is_empty() const { return bitmap[0] == 0 && bitmap[1] == 0; }
 };
 
 // stored in NVM
@@ -132,15 +172,39 @@ struct alignas(kCachelineSize) CowMeta {
     *(uint64_t *)log = new_cnt + 1;
     persistent::clflush(log);
   }
+
+  // move the last oid into the hole, then shrink the array.
+  void remove_oid(PMEMoid oid) {
+    uint64_t cnt = *(uint64_t *)log;
+    for (uint64_t k = 0; k < cnt; ++k) {
+      auto *p = oid_at(k);
+      if (p->off == oid.off && p->pool_uuid_lo == oid.pool_uuid_lo) {
+        *p = *oid_at(cnt - 1);
+        persistent::clwb_range(p, sizeof(PMEMoid));
+
+        *(uint64_t *)log = cnt - 1;
+        persistent::clflush(log);
+        return;
+      }
+    }
+  }
 };
 
 class BlockManager {
 public:
-  BlockManager(CowMeta *cow_meta) : meta(cow_meta) { meta->init(); }
+  // blocks come from ``pools[numa_id]``, numa_id < 0: from the pool of the
+  // calling thread.
+  BlockManager(CowMeta *cow_meta, pmem::obj::pool_base *pools,
+               int numa_id = -1)
+      : meta(cow_meta), pools(pools), numa_id(numa_id) {
+    meta->init();
+  }
 
   char *get_new_page(uint8_t cls) {
+    lock.wLock();
     if (free_blocks.empty()) {
-      if (pmemobj_alloc(Topology::pmdk_pool()->handle(), &meta->buf_ptr,
+      auto *pop = pools + (numa_id < 0 ? Topology::numaID() : numa_id);
+      if (pmemobj_alloc(pop->handle(), &meta->buf_ptr,
                         kBlockSize + 2 * kPageSize, 0, nullptr, nullptr)) {
         fprintf(stderr, "fail to alloc nvm\n");
         exit(-1);
@@ -154,29 +218,63 @@ public:
 
       ptr = (char *)(((uint64_t)ptr + kPageSize - 1) & (~(kPageSize - 1)));
 
-      BlockMeta bm(ptr);
+      auto *bm = new BlockMeta(ptr, meta->buf_ptr);
+      blocks[ptr] = bm;
       free_blocks.push_back(bm);
     }
 
     bool is_del = false;
-    auto res = free_blocks.back().get_new_page(is_del);
+    auto res = free_blocks.back()->get_new_page(is_del);
     if (is_del) {
       free_blocks.pop_back();
     }
+    lock.wUnlock();
 
     // printf("new page\n");
 
     return res;
   }
 
+  // give a page back to its block, and the block back to PMDK once it is
+  // completely unused.
+  void put_page(char *page) {
+    lock.wLock();
+    auto it = blocks.upper_bound(page);
+    assert(it != blocks.begin());
+    auto *bm = (--it)->second;
+    assert(bm->contains(page));
+
+    bool was_full = bm->is_full();
+    bm->put_page(page);
+
+    if (bm->is_empty()) {
+      if (!was_full) {
+        free_blocks.remove(bm);
+      }
+      blocks.erase(it);
+      meta->remove_oid(bm->oid);
+      pmemobj_free(&bm->oid);
+      delete bm;
+    } else if (was_full) {
+      free_blocks.push_front(bm);
+    }
+    lock.wUnlock();
+  }
+
+  size_t pm_bytes() const { return blocks.size() * (kBlockSize + 2 * kPageSize); }
+
 private:
   CowMeta *meta;
-  std::list<BlockMeta> free_blocks;
+  pmem::obj::pool_base *pools;
+  int numa_id;
+  WRLock lock; // the compactor returns pages from the shift thread
+  std::map<char *, BlockMeta *> blocks;
+  std::list<BlockMeta *> free_blocks;
 };
 
 class SlabManager {
 public:
-  SlabManager(BlockManager *blk_mgt) : blk_mgt(blk_mgt) {}
+  SlabManager(BlockManager *blk_mgt, uint32_t id) : blk_mgt(blk_mgt), id(id) {}
 
   char *alloc(size_t size) {
     if (size >= kSlabSizes[kSlabClass - 1]) {
@@ -199,38 +297,99 @@ public:
 
       assert((uint64_t)page_base % kPageSize == 0);
 
-      SlabPage *page = new (page_base) SlabPage(cls);
+      SlabPage *page = new (page_base) SlabPage(cls, id);
 
       free_list[cls].push_back(page);
     }
 
     bool need_del = false;
-    auto res = free_list[cls].back()->alloc(need_del);
+    auto page = free_list[cls].back();
+    auto res = page->alloc(need_del);
 
     if (need_del) {
       free_list[cls].pop_back();
+
+      // a full page only ever gets holes from now on, keep it for the
+      // compactor.
+      retired_lock.wLock();
+      retired_list[cls].push_back(page);
+      retired_lock.wUnlock();
     }
 
     return res;
   }
 
+  // mark retired pages whose occupancy is at most ``ratio`` as evacuating.
+  void collect_sparse_pages(double ratio, std::vector<SlabPage *> &pages) {
+    retired_lock.wLock();
+    for (size_t cls = 0; cls < kSlabClass; ++cls) {
+      for (auto it = retired_list[cls].begin();
+           it != retired_list[cls].end();) {
+        auto *page = *it;
+        if (page->live() <= ratio * page->capacity()) {
+          page->evacuating = 1;
+          pages.push_back(page);
+          it = retired_list[cls].erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    retired_lock.wUnlock();
+  }
+
+  BlockManager *block_manager() { return blk_mgt; }
+
 private:
   BlockManager *blk_mgt;
+  uint32_t id;
 
   std::list<SlabPage *> free_list[kSlabClass];
+
+  WRLock retired_lock;
+  std::list<SlabPage *> retired_list[kSlabClass];
 };
 
+// Per-thread slab allocator for the CoW values of the PC-view. The shift
+// thread additionally owns one manager per NUMA node, which the compactor
+// uses to move live values out of sparse pages.
 class CowAlloctor {
 
 private:
-  BlockManager *blk_mgt[kMaxThreadCnt];
-  SlabManager *slab_mgt[kMaxThreadCnt];
+  constexpr static int kMgtCnt = kMaxThreadCnt + kMaxNumaCnt;
+
+  BlockManager *blk_mgt[kMgtCnt];
+  SlabManager *slab_mgt[kMgtCnt];
+
+public:
+  // values a thread freed recently, reused by its next CoW writes
+  struct AllocBuffer {
+    uint32_t size;
+    char *buf;
+
+    AllocBuffer() : size(0), buf(nullptr) {}
+  };
+
+  constexpr static int kAllocBufferSize = 4;
+
+private:
+  struct alignas(kCachelineSize) ThreadAllocBuffer {
+    AllocBuffer b[kAllocBufferSize];
+  };
+
+  ThreadAllocBuffer alloc_bufs[kMaxThreadCnt];
+
+  // only touched by the shift thread
+  std::vector<SlabPage *> evacuating_pages;
 
 public:
-  CowAlloctor(CowMeta *meta) {
-    for (int k = 0; k < kMaxThreadCnt; ++k) {
-      blk_mgt[k] = new BlockManager(meta + k);
-      slab_mgt[k] = new SlabManager(blk_mgt[k]);
+  // ``meta`` has kMaxThreadCnt + kMaxNumaCnt entries, ``pools`` one per
+  // NUMA node
+  CowAlloctor(CowMeta *meta, pmem::obj::pool_base *pools) {
+    for (int k = 0; k < kMgtCnt; ++k) {
+      int numa_id = k < kMaxThreadCnt ? -1 : k - kMaxThreadCnt;
+      blk_mgt[k] = new BlockManager(meta + k, pools, numa_id);
+      slab_mgt[k] = new SlabManager(blk_mgt[k], k);
     }
   }
 
@@ -238,7 +397,52 @@ public:
     return slab_mgt[Topology::threadID()]->alloc(size);
   }
 
+  // used by the compactor (shift thread) only.
+  void *malloc_at(int numa_id, size_t size) {
+    return slab_mgt[kMaxThreadCnt + numa_id]->alloc(size);
+  }
+
   void free(void *addr) { SlabPage::free((char *)addr); }
+
+  AllocBuffer *thread_alloc_buf() {
+    return alloc_bufs[Topology::threadID()].b;
+  }
+
+  static bool is_evacuating(void *addr) {
+    return SlabPage::page_of(addr)->evacuating;
+  }
+
+  size_t select_sparse_pages(double ratio) {
+    for (int k = 0; k < kMgtCnt; ++k) {
+      slab_mgt[k]->collect_sparse_pages(ratio, evacuating_pages);
+    }
+    return evacuating_pages.size();
+  }
+
+  // return evacuated pages that became empty, the others are retried in the
+  // next round.
+  size_t release_empty_pages() {
+    size_t released = 0;
+    for (auto it = evacuating_pages.begin(); it != evacuating_pages.end();) {
+      auto *page = *it;
+      if (page->is_empty()) {
+        blk_mgt[page->owner]->put_page((char *)page);
+        it = evacuating_pages.erase(it);
+        released++;
+      } else {
+        ++it;
+      }
+    }
+    return released;
+  }
+
+  size_t pm_bytes() const {
+    size_t bytes = 0;
+    for (int k = 0; k < kMgtCnt; ++k) {
+      bytes += blk_mgt[k]->pm_bytes();
+    }
+    return bytes;
+  }
 };
 
 } // namespace nap
@@ -0,0 +1,171 @@
+#if !defined(_FLUSH_PACER_H_)
+#define _FLUSH_PACER_H_
+
+#include "timer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+namespace nap {
+
+// log2 buckets of sampled foreground operation latencies, one per thread
+struct LatencyHistogram {
+  constexpr static int kBuckets = 40;
+  uint64_t cnt[kBuckets];
+
+  LatencyHistogram() : cnt{} {}
+
+  void add(uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    cnt[std::min(b, kBuckets - 1)]++;
+  }
+
+  // upper bound of the bucket holding the ``p`` quantile, 0 if empty
+  static uint64_t quantile(const uint64_t *cnt, double p) {
+    uint64_t all = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+      all += cnt[b];
+    }
+    if (all == 0) {
+      return 0;
+    }
+
+    uint64_t rank = all * p;
+    uint64_t seen = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+      seen += cnt[b];
+      if (seen > rank) {
+        return 1ull << b;
+      }
+    }
+    return 1ull << (kBuckets - 1);
+  }
+};
+
+// Token bucket which paces the write-back of a switch to ``rate`` bytes of
+// raw index writes per second, so that the flush leaves PM write bandwidth
+// to the foreground. With a latency target, the foreground p99 is probed
+// every kAdjustNs during the flush: the rate is halved while it is above the
+// target and raised by a tenth of the configured rate otherwise, within
+// [min_rate, configured rate]. The adapted rate carries over to the next
+// switch. A flush is paced for at most ``max_flush_ns``, the rest of it
+// runs at full speed: keys leaving the hot set wait for its end.
+class FlushPacer {
+public:
+  // 0 disables pacing
+  void set_rate(uint64_t bytes_per_sec) {
+    max_rate = bytes_per_sec;
+    min_rate = std::min(min_rate, max_rate);
+    rate = bytes_per_sec;
+  }
+
+  // ``probe`` returns the foreground p99 since its previous call
+  void set_latency_target(uint64_t p99_ns, uint64_t min_bytes_per_sec,
+                          std::function<uint64_t()> probe) {
+    target_ns = p99_ns;
+    min_rate = std::max<uint64_t>(std::min(min_bytes_per_sec, max_rate), 1);
+    latency_probe = std::move(probe);
+  }
+
+  // 0 paces a flush however long it takes
+  void set_max_flush_time(uint64_t ns) { max_flush_ns = ns; }
+
+  bool is_enabled() const { return max_rate != 0; }
+
+  void begin() {
+    last_ns = Timer::get_time_ns();
+    deadline_ns = max_flush_ns ? last_ns + max_flush_ns : UINT64_MAX;
+    next_adjust_ns = last_ns + kAdjustNs;
+    tokens = burst();
+    bytes = 0;
+    waited_ns = 0;
+    worst_p99 = 0;
+    if (target_ns) {
+      latency_probe(); // restart the measurement
+    }
+  }
+
+  // account ``n`` bytes written back, wait until the bucket covers them
+  void consume(size_t n) {
+    if (!is_enabled()) {
+      return;
+    }
+
+    bytes += n;
+    tokens -= n;
+    if (tokens >= 0) {
+      return;
+    }
+
+    auto wait_begin = Timer::get_time_ns();
+    if (wait_begin >= deadline_ns) {
+      return;
+    }
+    refill();
+    while (tokens < 0 && Timer::get_time_ns() < deadline_ns) {
+      uint64_t ns = -tokens * 1e9 / rate;
+      std::this_thread::sleep_for(
+          std::chrono::nanoseconds(std::min(ns, kMaxSleepNs)));
+      refill();
+    }
+    waited_ns += Timer::get_time_ns() - wait_begin;
+  }
+
+  uint64_t get_bytes() const { return bytes; }
+
+  // time the flush spent waiting for tokens
+  uint64_t get_waited_ns() const { return waited_ns; }
+
+  uint64_t get_rate() const { return rate; }
+
+  // worst foreground p99 probed during the flush, 0 without a target
+  uint64_t get_worst_p99() const { return worst_p99; }
+
+private:
+  constexpr static uint64_t kAdjustNs = 10ull * 1000 * 1000;
+  constexpr static uint64_t kMaxSleepNs = 1000ull * 1000;
+  constexpr static uint64_t kBurstNs = 1000ull * 1000;
+  constexpr static double kMinBurst = 4096;
+  constexpr static uint64_t kDefaultMaxFlushNs = 1000ull * 1000 * 1000;
+
+  double burst() const { return std::max(rate * kBurstNs / 1e9, kMinBurst); }
+
+  void refill() {
+    auto now = Timer::get_time_ns();
+    tokens = std::min(burst(), tokens + (now - last_ns) * rate / 1e9);
+    last_ns = now;
+
+    if (target_ns && now >= next_adjust_ns) {
+      next_adjust_ns = now + kAdjustNs;
+      auto p99 = latency_probe();
+      worst_p99 = std::max(worst_p99, p99);
+      if (p99 > target_ns) {
+        rate = std::max(rate / 2, min_rate);
+      } else if (p99) {
+        rate = std::min(rate + max_rate / 10, max_rate);
+      }
+    }
+  }
+
+  uint64_t max_rate{0};
+  uint64_t min_rate{0};
+  uint64_t rate{0};
+  uint64_t target_ns{0};
+  std::function<uint64_t()> latency_probe;
+  uint64_t max_flush_ns{kDefaultMaxFlushNs};
+  uint64_t deadline_ns{UINT64_MAX};
+
+  double tokens{0};
+  uint64_t last_ns{0};
+  uint64_t next_adjust_ns{0};
+  uint64_t bytes{0};
+  uint64_t waited_ns{0};
+  uint64_t worst_p99{0};
+};
+
+} // namespace nap
+
+#endif // _FLUSH_PACER_H_
@@ -0,0 +1,410 @@
+#if !defined(_HOT_SET_DETECTOR_H_)
+#define _HOT_SET_DETECTOR_H_
+
+#include "nap_common.h"
+#include "slice.h"
+#include "timer.h"
+#include "top_k.h"
+#include "topology.h"
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+namespace nap {
+
+constexpr int kRecordKeySize = 48;   // longer keys are kept in a LongKey
+constexpr int kLongKeySize = 1008;   // longer keys are not sampled
+
+// A sampled key with the number of samples a thread folded into it, one
+// cache line with the key inline. ``timestamp`` is cleared while a ring
+// slot is rewritten and set last, so that the reader can tell a torn copy.
+// A key longer than kRecordKeySize is replaced by a LongKeyRef.
+struct alignas(kCachelineSize) PerRecord {
+  uint64_t timestamp; // the key's fingerprint while folding
+  uint16_t key_size;
+  uint16_t cnt;
+  uint16_t writes;
+  uint8_t numa;
+  uint8_t padding;
+  char key[kRecordKeySize];
+};
+
+static_assert(sizeof(PerRecord) == kCachelineSize, "XX");
+
+// a long key of a thread, which records refer to. ``seq`` is odd while
+// the slot is rewritten, a reader whose reference carries another ``seq``
+// drops the record.
+struct alignas(kCachelineSize) LongKey {
+  uint64_t seq;
+  uint32_t size;
+  char key[kLongKeySize];
+};
+
+static_assert(sizeof(LongKey) == 1024, "XX");
+
+struct LongKeyRef {
+  uint32_t slot;
+  uint64_t seq;
+};
+
+struct RecordCursor {
+  uint64_t last_ts;
+  uint32_t last_index;
+  uint64_t next_steal_tsc; // see ``steal_folds``
+
+  RecordCursor() : last_ts(0), last_index(0), next_steal_tsc(0) {}
+};
+
+// samples of a thread not published yet, in a small table indexed by the
+// key's fingerprint, so that repeated hot keys become one record. The
+// thread holds ``busy`` while it samples; the reader of its ring takes it
+// to publish the folds of a thread which stopped sampling.
+struct alignas(kCachelineSize) ThreadSampler {
+  constexpr static int kFoldSlots = 256;
+  constexpr static int kLongKeySlots = 512;
+
+  std::atomic<uint32_t> busy;
+  uint32_t index;     // next slot of the thread's ring
+  uint32_t samples;   // folded since the last publish
+  uint64_t begin_tsc; // of the first of them
+  uint32_t singles;   // keys sampled once, see ``publish``
+  uint32_t long_next; // next slot of ``long_keys``
+  LongKey *long_keys; // allocated with the first long key
+  PerRecord fold[kFoldSlots];
+
+  ThreadSampler()
+      : busy(0), index(0), samples(0), begin_tsc(0), singles(0),
+        long_next(0), long_keys(nullptr), fold() {}
+
+  ~ThreadSampler() { delete[] long_keys; }
+
+  // copy ``key`` into the next long key slot, refer to it from ``f``
+  void save_long_key(PerRecord &f, const Slice &key) {
+    if (long_keys == nullptr) {
+      long_keys = new LongKey[kLongKeySlots]();
+    }
+    uint32_t slot = long_next++ % kLongKeySlots;
+    auto &l = long_keys[slot];
+
+    uint64_t seq = l.seq + 1;
+    __atomic_store_n(&l.seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    l.size = key.size();
+    memcpy(l.key, key.data(), key.size());
+    __atomic_store_n(&l.seq, seq + 1, __ATOMIC_RELEASE);
+
+    LongKeyRef ref{slot, seq + 1};
+    memcpy(f.key, &ref, sizeof(ref));
+  }
+};
+
+// a sampled access, as handed to the detector
+struct SampledAccess {
+  Slice key;
+  uint32_t cnt;    // samples folded into it
+  uint32_t writes; // how many of them are writes
+  int numa;
+};
+
+// Hot-key detection of the shift thread. Foreground threads fold sampled
+// accesses per key and publish them into per-thread record rings,
+// ``poll_workloads`` feeds them to the detector, whose candidates
+// ``get_list`` returns as a heap (index 0 is a fence) until the next
+// ``reset``. A detector without rings is fed by ``drain`` from the rings of
+// another, and ``merge``d into it.
+class HotSetDetector {
+protected:
+  constexpr static uint32_t kRecordBufferSize = 4096;
+  // a thread publishes its folded samples after this many of them, or
+  // this many cycles after the first one (checked every kClockSamples)
+  constexpr static uint32_t kFoldSamples = 4096;
+  constexpr static uint64_t kFoldCycles = 2ull * 1000 * 1000;
+  constexpr static uint32_t kClockSamples = 64;
+  // only one in this many keys sampled once per fold is published, as
+  // that many samples; the long tail of a skewed workload is what such
+  // keys are, and none of them is near the hot set
+  constexpr static uint32_t kTailThin = 8;
+  constexpr static size_t kBatchPerThread = 8;
+
+  PerRecord *record_buffer[kMaxThreadCnt];
+  RecordCursor cursors[kMaxThreadCnt];
+  ThreadSampler *samplers; // with the rings only
+
+public:
+  constexpr static uint64_t kStopCheckNs = 10ull * 1000 * 1000;
+
+  HotSetDetector(bool with_rings = true)
+      : samplers(with_rings ? new ThreadSampler[kMaxThreadCnt] : nullptr) {
+    for (int i = 0; i < kMaxThreadCnt; ++i) {
+      record_buffer[i] =
+          with_rings ? new PerRecord[kRecordBufferSize]() : nullptr;
+    }
+  }
+
+  virtual ~HotSetDetector() {
+    for (int i = 0; i < kMaxThreadCnt; ++i) {
+      if (record_buffer[i]) {
+        delete[] record_buffer[i];
+      }
+    }
+    delete[] samplers;
+  }
+
+  virtual std::vector<Node> &get_list() = 0;
+
+  // how many keys are kept as candidates, from the next reset on
+  virtual void set_candidates(int k) = 0;
+
+  virtual void reset() = 0;
+
+  // estimated sampled accesses of ``key`` since the last reset
+  virtual uint32_t query(const Slice &key) = 0;
+
+  // whether ``key`` may have been sampled since the last reset. A detector
+  // whose counts decay over windows answers from the current window only.
+  virtual bool sampled_in_window(const Slice &key) { return query(key) != 0; }
+
+  virtual void access(const SampledAccess &a) = 0;
+
+  // add the samples and candidates of ``other``, a detector of the same
+  // kind reset at the same time
+  virtual void merge(HotSetDetector &other) = 0;
+
+  void access_a_key(const Slice &key, bool is_write = false, int numa = 0) {
+    access({key, 1, is_write ? 1u : 0u, numa});
+  }
+
+  // detectors which overlap the memory accesses of a batch override this
+  virtual void access_batch(const SampledAccess *batch, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      access(batch[i]);
+    }
+  }
+
+  // called by the threads that access keys, of a detector with rings.
+  // The sample is dropped in the rare case that the reader of the ring is
+  // publishing the thread's folds.
+  void record(const Slice &key, bool is_write = false) {
+    if (key.size() > (size_t)kLongKeySize) {
+      return;
+    }
+
+    int tid = Topology::threadID();
+    auto &s = samplers[tid];
+    uint32_t idle = 0;
+    if (!s.busy.compare_exchange_strong(idle, 1, std::memory_order_acquire)) {
+      return;
+    }
+    fold(tid, s, key, is_write);
+    s.busy.store(0, std::memory_order_release);
+  }
+
+  // feed up to kBatchPerThread records of thread ``tid`` to ``into``,
+  // return how many
+  size_t drain(int tid, HotSetDetector *into) {
+    PerRecord copies[kBatchPerThread];
+    SampledAccess batch[kBatchPerThread];
+    char long_copies[kBatchPerThread][kLongKeySize];
+    auto &c = cursors[tid];
+
+    size_t n = 0;
+    size_t read = 0;
+    while (read < kBatchPerThread) {
+      auto &r = record_buffer[tid][c.last_index];
+      auto ts = __atomic_load_n(&r.timestamp, __ATOMIC_ACQUIRE);
+      if (ts == 0 || ts < c.last_ts) {
+        break; // invalid record
+      }
+
+      auto &copy = copies[n];
+      memcpy(&copy, &r, sizeof(PerRecord));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&r.timestamp, __ATOMIC_RELAXED) != ts) {
+        break; // overwritten while copied, read again next round
+      }
+
+      c.last_ts = ts;
+      c.last_index = (c.last_index + 1) % kRecordBufferSize;
+      read++;
+
+      const char *key = copy.key;
+      if (copy.key_size > kRecordKeySize) {
+        if (!copy_long_key(tid, copy, long_copies[n])) {
+          continue; // its slot was reused, the record is lost
+        }
+        key = long_copies[n];
+      }
+      batch[n++] = {Slice(key, copy.key_size), copy.cnt, copy.writes,
+                    copy.numa};
+    }
+
+    // update the detector
+    if (n) {
+      into->access_batch(batch, n);
+    }
+    if (read == 0) {
+      steal_folds(tid);
+    }
+    return read;
+  }
+
+  // one round over the rings (of socket ``numa`` only, if set), return
+  // whether it found any record
+  bool poll_round(int numa = -1) {
+    size_t n = 0;
+    for (int i = 0; i < kMaxThreadCnt; ++i) {
+      if (numa < 0 || Topology::numaOf(i) == numa) {
+        n += drain(i, this);
+      }
+    }
+    return n > 0;
+  }
+
+  // ``idle_task`` is invoked whenever a whole round finds no new record.
+  // ``stop`` is asked every kStopCheckNs whether to end the window early,
+  // return true if it did. With ``numa`` set, only the threads of that
+  // socket are polled.
+  bool poll_workloads(double seconds,
+                      const std::function<void()> &idle_task = nullptr,
+                      const std::function<bool()> &stop = nullptr,
+                      int numa = -1) {
+
+    uint64_t ns = seconds * (1000ull * 1000 * 1000);
+    uint64_t next_check = kStopCheckNs;
+    Timer timer;
+    timer.begin();
+
+    while (true) {
+      bool is_idle = true;
+      for (int i = 0; i < kMaxThreadCnt; ++i) {
+        if (numa >= 0 && Topology::numaOf(i) != numa) {
+          continue;
+        }
+        if (drain(i, this)) {
+          is_idle = false;
+        }
+
+        auto elapsed = timer.end();
+        if (elapsed > ns) {
+          return false;
+        }
+        if (stop && elapsed > next_check) {
+          next_check = elapsed + kStopCheckNs;
+          if (stop()) {
+            return true;
+          }
+        }
+      }
+
+      if (is_idle && idle_task) {
+        idle_task();
+      }
+    }
+  }
+
+private:
+  void fold(int tid, ThreadSampler &s, const Slice &key, bool is_write) {
+    auto fp = key_fingerprint(key);
+
+    auto &f = s.fold[fp % ThreadSampler::kFoldSlots];
+    if (f.timestamp != fp) {
+      if (f.timestamp) {
+        publish(tid, f);
+      }
+      f.timestamp = fp;
+      f.key_size = key.size();
+      f.cnt = f.writes = 0;
+      f.numa = Topology::numaID();
+      if (key.size() <= (size_t)kRecordKeySize) {
+        memcpy(f.key, key.data(), key.size());
+      } else {
+        s.save_long_key(f, key);
+      }
+    }
+
+    f.writes += is_write;
+    if (++f.cnt == UINT16_MAX) {
+      publish(tid, f);
+      f.timestamp = 0;
+    }
+
+    if (s.samples++ == 0) {
+      s.begin_tsc = asm_rdtsc();
+    } else if (s.samples >= kFoldSamples ||
+               (s.samples % kClockSamples == 0 &&
+                asm_rdtsc() - s.begin_tsc > kFoldCycles)) {
+      publish_folds(tid, s);
+    }
+  }
+
+  void publish_folds(int tid, ThreadSampler &s) {
+    for (auto &slot : s.fold) {
+      if (slot.timestamp) {
+        publish(tid, slot);
+        slot.timestamp = 0;
+      }
+    }
+    s.samples = 0;
+  }
+
+  // folds of a thread which stopped sampling are published by the reader
+  // of its ring, at most once per kFoldCycles
+  void steal_folds(int tid) {
+    auto &c = cursors[tid];
+    auto now = asm_rdtsc();
+    if (samplers == nullptr || now < c.next_steal_tsc) {
+      return;
+    }
+    c.next_steal_tsc = now + kFoldCycles;
+
+    auto &s = samplers[tid];
+    uint32_t idle = 0;
+    if (!s.busy.compare_exchange_strong(idle, 2, std::memory_order_acquire)) {
+      return;
+    }
+    if (s.samples && now - s.begin_tsc > kFoldCycles) {
+      publish_folds(tid, s);
+    }
+    s.busy.store(0, std::memory_order_release);
+  }
+
+  // the long key of record ``r`` of thread ``tid`` into ``buf``, false if
+  // its slot was rewritten since
+  bool copy_long_key(int tid, const PerRecord &r, char *buf) {
+    LongKeyRef ref;
+    memcpy(&ref, r.key, sizeof(ref));
+    auto &l = samplers[tid].long_keys[ref.slot];
+    if (__atomic_load_n(&l.seq, __ATOMIC_ACQUIRE) != ref.seq) {
+      return false;
+    }
+    memcpy(buf, l.key, r.key_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&l.seq, __ATOMIC_RELAXED) == ref.seq;
+  }
+
+  void publish(int tid, PerRecord &f) {
+    auto &s = samplers[tid];
+    if (f.cnt == 1) {
+      if (++s.singles % kTailThin) {
+        return;
+      }
+      f.cnt = kTailThin;
+      f.writes *= kTailThin;
+    }
+
+    auto &r = record_buffer[tid][s.index];
+    __atomic_store_n(&r.timestamp, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)&r + sizeof(uint64_t), (const char *)&f + sizeof(uint64_t),
+           sizeof(PerRecord) - sizeof(uint64_t));
+    __atomic_store_n(&r.timestamp, asm_rdtsc(), __ATOMIC_RELEASE);
+
+    s.index = (s.index + 1) % kRecordBufferSize;
+  }
+};
+
+} // namespace nap
+
+#endif // _HOT_SET_DETECTOR_H_
@@ -0,0 +1,136 @@
+#if !defined(_HOT_SET_HISTORY_H_)
+#define _HOT_SET_HISTORY_H_
+
+#include "murmur_hash2.h"
+#include "nap_common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <vector>
+
+namespace nap {
+
+// Hot sets switched to in the past, grouped into patterns by their
+// fingerprint, with the times they came back. A pattern seen at a steady
+// period is expected again one period after its last occurrence.
+class HotSetHistory {
+public:
+  constexpr static int kSigSize = 64;
+
+  // the hot set of a switch, as handed to NapMeta
+  struct HotSet {
+    std::vector<NapPair> list; // sorted by key
+    std::vector<uint32_t> write_freq;
+    std::vector<bool> dram_only;
+    size_t spare_slots{0};
+  };
+
+  struct Pattern {
+    std::vector<uint64_t> sig; // bottom-k of the key hashes, sorted
+    std::vector<uint64_t> seen_ns;
+    uint64_t predicted_ns{0}; // last occurrence returned by ``predict``
+    HotSet hot_set;
+  };
+
+  // bottom-k MinHash of the keys
+  static std::vector<uint64_t> fingerprint(const std::vector<NapPair> &list) {
+    std::vector<uint64_t> sig;
+    sig.reserve(list.size());
+    for (auto &p : list) {
+      sig.push_back(MurmurHash64A(p.first.data(), p.first.size()));
+    }
+    if (sig.size() > (size_t)kSigSize) {
+      std::nth_element(sig.begin(), sig.begin() + kSigSize, sig.end());
+      sig.resize(kSigSize);
+    }
+    std::sort(sig.begin(), sig.end());
+    return sig;
+  }
+
+  // Jaccard similarity estimated from two bottom-k signatures
+  static double similarity(const std::vector<uint64_t> &a,
+                           const std::vector<uint64_t> &b) {
+    size_t i = 0, j = 0, k = 0, both = 0;
+    while (k < (size_t)kSigSize && (i < a.size() || j < b.size())) {
+      if (j == b.size() || (i < a.size() && a[i] < b[j])) {
+        i++;
+      } else if (i == a.size() || b[j] < a[i]) {
+        j++;
+      } else {
+        i++, j++, both++;
+      }
+      k++;
+    }
+    return k ? both * 1.0 / k : 0;
+  }
+
+  // the hot set switched to at ``now_ns``
+  void record(HotSet &&hot_set, uint64_t now_ns) {
+    auto sig = fingerprint(hot_set.list);
+
+    auto it = patterns.begin();
+    for (; it != patterns.end(); ++it) {
+      if (similarity(sig, it->sig) >= kSameSimilarity) {
+        break;
+      }
+    }
+
+    if (it == patterns.end()) {
+      if (patterns.size() == kMaxPatterns) {
+        patterns.pop_back();
+      }
+      patterns.push_front(Pattern());
+    } else {
+      patterns.splice(patterns.begin(), patterns, it);
+    }
+
+    auto &p = patterns.front();
+    p.sig.swap(sig);
+    p.hot_set = std::move(hot_set);
+    p.seen_ns.push_back(now_ns);
+    if (p.seen_ns.size() > kMaxSeen) {
+      p.seen_ns.erase(p.seen_ns.begin());
+    }
+  }
+
+  // a pattern expected back within ``lead_ns`` from ``now_ns``, which was
+  // not returned for that occurrence yet; nullptr if none.
+  const Pattern *predict(uint64_t now_ns, uint64_t lead_ns) {
+    for (auto &p : patterns) {
+      auto n = p.seen_ns.size();
+      if (n < 2) {
+        continue;
+      }
+
+      uint64_t period = p.seen_ns[n - 1] - p.seen_ns[n - 2];
+      if (n >= 3) { // the period has to be steady
+        uint64_t pre = p.seen_ns[n - 2] - p.seen_ns[n - 3];
+        if (std::max(pre, period) - std::min(pre, period) >
+            kPeriodTolerance * period) {
+          continue;
+        }
+      }
+
+      uint64_t next = p.seen_ns[n - 1] + period;
+      if (next <= now_ns + lead_ns && now_ns < next + lead_ns &&
+          p.predicted_ns != next) {
+        p.predicted_ns = next;
+        return &p;
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  constexpr static size_t kMaxPatterns = 8;
+  constexpr static size_t kMaxSeen = 4;
+  constexpr static double kSameSimilarity = 0.7;
+  constexpr static double kPeriodTolerance = 0.2;
+
+  std::list<Pattern> patterns; // most recently seen first
+};
+
+} // namespace nap
+
+#endif // _HOT_SET_HISTORY_H_
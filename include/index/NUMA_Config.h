@@ -32,4 +32,7 @@ void init_numa_pool();
 void *index_pmem_alloc(size_t size);
 void index_pmem_free(void *ptr);
 
+// socket of the pool holding ``ptr``, -1 if it is in none of them
+int index_numa_of(const void *ptr);
+
 #endif // _NUMA_CONFIG
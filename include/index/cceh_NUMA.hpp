@@ -607,6 +607,88 @@ public:
     return ret();
   }
 
+  /*
+  KV buffer of the key, nullptr if it is absent.
+  description:
+          Only a hint of where the item lives, the buffer may be
+          replaced concurrently and is not dereferenced.
+  */
+  const void *kv_of(const key_type &key, size_type key_len) {
+    hv_type key_hash = hasher{}(key, key_len);
+    size_type y = (key_hash & kMask) * kNumPairPerCacheLine;
+    const void *res = nullptr;
+
+    dir_lock.read_lock();
+
+    size_type x = (key_hash >> (8 * sizeof(key_hash) - dir->depth));
+    persistent_ptr<segment> target_segment = dir->segments[x];
+
+    scoped_t lock_target_segment(target_segment->segment_lock, false);
+    for (unsigned i = 0; i < kNumPairPerCacheLine * kNumCacheLine; ++i) {
+      auto &kv = target_segment->slots[(y + i) % KNumSlot];
+      if (kv.kv != nullptr && kv.get_key_len() == key_len &&
+          key_equal{}(key, kv.get_key(), key_len)) {
+        res = kv.kv;
+        break;
+      }
+    }
+
+    lock_target_segment.release();
+    dir_lock.read_unlock();
+    return res;
+  }
+
+  /*
+  directory index of the key's segment.
+  description:
+          Only a hint for ordering a batch of inserts, the
+          directory may be doubled concurrently.
+  */
+  size_type segment_of(const key_type &key, size_type key_len) {
+    hv_type key_hash = hasher{}(key, key_len);
+    return key_hash >> (8 * sizeof(key_hash) - dir->depth);
+  }
+
+  /*
+  unlink the item and free its KV buffer.
+  description:
+          The segment writer lock keeps readers away from the
+          buffer being freed.
+  */
+  ret erase(const key_type &key, size_type key_len) {
+    hv_type key_hash = hasher{}(key, key_len);
+    size_type y = (key_hash & kMask) * kNumPairPerCacheLine;
+    pool_base pop = get_pool_base();
+
+    dir_lock.read_lock();
+
+    size_type x = (key_hash >> (8 * sizeof(key_hash) - dir->depth));
+    persistent_ptr<segment> target_segment = dir->segments[x];
+
+    scoped_t lock_target_segment(target_segment->segment_lock,
+                                 true); // true：write lock，false: read lock
+    for (unsigned i = 0; i < kNumPairPerCacheLine * kNumCacheLine; ++i) {
+      size_type location = (y + i) % KNumSlot;
+      auto &kv = target_segment->slots[location];
+      if (kv.kv != nullptr && kv.get_key_len() == key_len &&
+          key_equal{}(key, kv.get_key(), key_len)) {
+        uint8_t *old_ptr = kv.kv;
+        kv.kv = nullptr;
+        pop.persist(&kv.kv, sizeof(uint8_t *));
+
+        lock_target_segment.release();
+        dir_lock.read_unlock();
+
+        index_pmem_free(old_ptr);
+        return ret(x, y);
+      }
+    }
+
+    lock_target_segment.release();
+    dir_lock.read_unlock();
+    return ret();
+  }
+
   size_t Capacity(void) {
     std::unordered_map<segment *, bool> set;
     for (size_t i = 0; i < dir->capacity; ++i) {
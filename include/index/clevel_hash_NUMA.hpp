@@ -394,6 +394,10 @@ public:
 	// mapped_type
 	ret search(const key_type &key) const;
 
+	// KV pair of the key, nullptr if it is absent. Only a hint of where
+	// the pair lives, it may be moved concurrently.
+	const void *kv_of(const key_type &key) const;
+
 	ret erase(const key_type &key, size_type thread_id);
 
 	ret
@@ -629,6 +633,43 @@ clevel_hash<Key, T, Hash, KeyEqual, HashPower>::search(
 	} // end while(true)
 }
 
+template <typename Key, typename T, typename Hash, typename KeyEqual,
+	  size_t HashPower>
+const void *
+clevel_hash<Key, T, Hash, KeyEqual, HashPower>::kv_of(
+	const key_type &key) const
+{
+	hv_type hv = hasher{}(key);
+	partial_t partial = get_partial(hv);
+
+	level_meta_ptr_t m_copy = meta;
+	level_meta *m = m_copy;
+	level_ptr_t li = nullptr, next_li = m->last_level;
+	do {
+		li = next_li;
+		level_bucket *cl = li;
+		difference_type f_idx = first_index(hv, cl->capacity);
+		difference_type s_idx =
+			second_index(partial, f_idx, cl->capacity);
+
+		for (auto idx : {f_idx, s_idx}) {
+			bucket &b = cl->buckets[idx];
+			for (size_type j = 0; j < assoc_num; j++) {
+				if (b.slots[j].x.partial == partial &&
+				    b.slots[j].p != 0 &&
+				    key_equal{}(GetPtr(b.slots[j].p)->first,
+						key)) {
+					return GetPtr(b.slots[j].p);
+				}
+			}
+		}
+
+		next_li = cl->up;
+	} while (li != m->first_level);
+
+	return nullptr;
+}
+
 template <typename Key, typename T, typename Hash, typename KeyEqual,
 	  size_t HashPower>
 void
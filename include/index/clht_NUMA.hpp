@@ -294,6 +294,11 @@ public:
     *lock = LOCK_FREE;
   }
 
+  /* bucket of the key, a hint for ordering a batch of puts */
+  size_type bucket_of(const key_type &key) const {
+    return hasher{}(key) % static_cast<hv_type>(ht->num_buckets);
+  }
+
   ret get(const key_type &key) const {
     hv_type hv = hasher{}(key);
     clht_hashtable_s *ht_ptr = ht;
@@ -316,6 +321,27 @@ public:
     return ret();
   }
 
+  // KV pair of the key, nullptr if it is absent. Only a hint of where the
+  // pair lives, it may be replaced concurrently.
+  const void *kv_of(const key_type &key) const {
+    hv_type hv = hasher{}(key);
+    clht_hashtable_s *ht_ptr = ht;
+    bucket_s *bucket =
+        &ht_ptr->table[hv % static_cast<hv_type>(ht_ptr->num_buckets)];
+
+    do {
+      for (size_t j = 0; j < ENTRIES_PER_BUCKET; j++) {
+        kv_ptr_t kv = bucket->slots[j];
+        if (kv != nullptr && key_equal{}(kv->first, key))
+          return kv;
+      }
+
+      bucket = bucket->next;
+    } while (unlikely(bucket != nullptr));
+
+    return nullptr;
+  }
+
   bool key_exists(bucket_s *bucket, const key_type &key) const {
     do {
       for (size_t j = 0; j < ENTRIES_PER_BUCKET; j++) {
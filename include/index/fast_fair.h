@@ -106,6 +106,8 @@ public:
   void getNumberOfNodes() __attribute__((optimize(0)));
   void btree_insert(uint64_t, char *) __attribute__((optimize(0)));
   void btree_insert(char *, char *) __attribute__((optimize(0)));
+  void btree_insert_sorted(char **, char **, size_t)
+      __attribute__((optimize(0)));
   void btree_insert_internal(char *, uint64_t, char *, uint32_t)
       __attribute__((optimize(0)));
   void btree_insert_internal(char *, key_item *, char *, uint32_t)
@@ -115,6 +117,8 @@ public:
   //    (entry_key_t, char *, uint32_t, entry_key_t *, bool *, page **);
   char *btree_search(uint64_t) __attribute__((optimize(0)));
   char *btree_search(char *) __attribute__((optimize(0)));
+  // leaf which holds the key, NULL if it is absent
+  char *btree_search_leaf(char *) __attribute__((optimize(0)));
   void btree_search_range(uint64_t, uint64_t, unsigned long *, int, int &)
       __attribute__((optimize(0)));
   void btree_search_range(char *, char *, unsigned long *, int, int &)
@@ -1936,6 +1940,27 @@ char *btree::btree_search(char *key) {
   return (char *)t;
 }
 
+char *btree::btree_search_leaf(char *key) {
+  page *p = (page *)root;
+
+  key_item *new_item = make_key_item(key, strlen(key) + 1, false);
+
+  while (p->hdr.leftmost_ptr != NULL) {
+    p = (page *)p->linear_search(new_item);
+  }
+
+  page *t;
+  while ((t = (page *)p->linear_search(new_item)) == p->hdr.sibling_ptr) {
+    p = t;
+    if (!p) {
+      break;
+    }
+  }
+  free(new_item);
+
+  return t ? (char *)p : NULL;
+}
+
 // insert the key in the leaf node
 void btree::btree_insert(uint64_t key, char *right) { // need to be string
   page *p = (page *)root;
@@ -1964,6 +1989,28 @@ void btree::btree_insert(char *key, char *right) { // need to be string
   }
 }
 
+// insert string keys given in ascending order. Each key starts from the
+// leaf the previous one went to instead of the root, store() moves right
+// along the siblings if it belongs further right.
+void btree::btree_insert_sorted(char **keys, char **rights, size_t n) {
+  page *leaf = NULL;
+
+  for (size_t i = 0; i < n; ++i) {
+    key_item *new_item = make_key_item(keys[i], strlen(keys[i]) + 1, true);
+
+    page *ret = leaf ? leaf->store(this, NULL, new_item, rights[i], true, true)
+                     : NULL;
+    while (ret == NULL) { // no leaf yet, or it was deleted
+      page *p = (page *)root;
+      while (p->hdr.leftmost_ptr != NULL) {
+        p = (page *)p->linear_search(new_item);
+      }
+      ret = p->store(this, NULL, new_item, rights[i], true, true);
+    }
+    leaf = ret;
+  }
+}
+
 // store the integer key into the node at the given level
 void btree::btree_insert_internal(char *left, uint64_t key, char *right,
                                   uint32_t level) {
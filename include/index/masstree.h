@@ -59,6 +59,8 @@ typedef struct key_indexed_position {
   inline constexpr key_indexed_position(int i_, int p_) : i(i_), p(p_) {}
 } key_indexed_position;
 
+class leafnode;
+
 class masstree {
 private:
   void *root_;
@@ -82,7 +84,10 @@ public:
 
   void put(uint64_t key, void *value, MASS::ThreadInfo &threadEpocheInfo);
 
-  void put(const char *key, uint64_t value, MASS::ThreadInfo &threadEpocheInfo);
+  // with ``leaf_hint``, keys put in ascending order start from the leaf of
+  // the previous one instead of the root
+  void put(const char *key, uint64_t value, MASS::ThreadInfo &threadEpocheInfo,
+           leafnode **leaf_hint = NULL);
 
   void put(const char *key, char *value, uint32_t value_size,
            MASS::ThreadInfo &threadEpocheInfo) {
@@ -102,6 +107,10 @@ public:
 
   void *get(const char *key, MASS::ThreadInfo &threadEpocheInfo);
 
+  // the PM leafvalue of the key (its key and value), NULL if it is absent
+  leafvalue *get_leafvalue(const char *key,
+                           MASS::ThreadInfo &threadEpocheInfo);
+
   bool get(const char *key, std::string &str, uint32_t value_size,
            MASS::ThreadInfo &threadEpocheInfo) {
     char *v = (char *)get(key, threadEpocheInfo);
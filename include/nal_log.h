@@ -0,0 +1,385 @@
+#if !defined(_NAL_LOG_H_)
+#define _NAL_LOG_H_
+
+#include "nap_common.h"
+#include "nvm.h"
+#include "rw_lock.h"
+#include "slice.h"
+#include "sp_view.h"
+#include "topology.h"
+
+#include <vector>
+
+namespace nap {
+
+constexpr size_t kLogSegmentSize = 1024 * 1024;
+
+// An append-only PM segment, owned by one thread during one epoch.
+struct alignas(kCachelineSize) LogSegment {
+  uint64_t gen; // bumped every time the segment is recycled
+  PMEMoid oid;
+  PMEMoid prev; // the previous segment of the thread in the same view
+  char padding[kCachelineSize - sizeof(uint64_t) - 2 * sizeof(PMEMoid)];
+
+  char *data() { return (char *)this + sizeof(LogSegment); }
+
+  constexpr static size_t capacity() {
+    return kLogSegmentSize - sizeof(LogSegment);
+  }
+};
+
+// | index | size | gen | version | value (8-byte aligned) |
+struct __attribute__((__packed__)) LogRecord {
+  uint32_t index;
+  uint16_t size;
+  uint16_t gen; // must match the segment, otherwise it is the end of log
+  uint64_t version;
+
+  constexpr static uint16_t kTombstone = 0xffff;
+
+  char *value() { return (char *)this + sizeof(LogRecord); }
+
+  bool is_deleted() const { return size == kTombstone; }
+
+  static size_t length(size_t value_size) {
+    return sizeof(LogRecord) + ((value_size + 7) & ~7ull);
+  }
+
+  // offset of a record appended at ``offset``: a header never straddles
+  // two cache lines, so that it cannot be persisted torn
+  static size_t header_at(size_t offset) {
+    if (offset % kCachelineSize > kCachelineSize - sizeof(LogRecord)) {
+      offset = (offset + kCachelineSize - 1) & ~(kCachelineSize - 1ull);
+    }
+    return offset;
+  }
+};
+
+static_assert(sizeof(LogRecord) == 16, "XX");
+
+// per-NUMA free lists of segments retired by previous epochs.
+class LogSegmentPool {
+public:
+  // new segments come from ``pools``, one per NUMA node
+  explicit LogSegmentPool(pmem::obj::pool_base *pools) : pools(pools) {}
+
+  pmem::obj::pool_base *pool_at(int numa_id) { return pools + numa_id; }
+
+  LogSegment *get(int numa_id) {
+    LogSegment *seg = nullptr;
+
+    locks[numa_id].l.wLock();
+    if (!free_list[numa_id].empty()) {
+      seg = free_list[numa_id].back();
+      free_list[numa_id].pop_back();
+    }
+    locks[numa_id].l.wUnlock();
+
+    if (seg) {
+      if ((uint16_t)(seg->gen + 1) == 0) {
+        // records keep 16 bits of the gen: clear the log once they wrap, so
+        // that neither zeroes nor a record 65536 recycles old match it
+        memset(seg->data(), 0, LogSegment::capacity());
+        persistent::clwb_range(seg->data(), LogSegment::capacity());
+        seg->gen++;
+      }
+      seg->gen++;
+      persistent::clflush(&seg->gen);
+      return seg;
+    }
+
+    // zeroed once, so that garbage is never taken as a record
+    PMEMoid oid;
+    if (pmemobj_zalloc(pools[numa_id].handle(), &oid,
+                       kLogSegmentSize + kCachelineSize, 0)) {
+      fprintf(stderr, "fail to alloc nvm for NAL log\n");
+      exit(-1);
+    }
+
+    auto *ptr = (char *)pmemobj_direct(oid);
+    ptr = (char *)(((uint64_t)ptr + kCachelineSize - 1) &
+                   (~(kCachelineSize - 1ull)));
+
+    seg = (LogSegment *)ptr;
+    seg->gen = 1;
+    seg->oid = oid;
+    persistent::clflush(seg);
+
+    return seg;
+  }
+
+  void put(int numa_id, LogSegment *seg) {
+    locks[numa_id].l.wLock();
+    free_list[numa_id].push_back(seg);
+    locks[numa_id].l.wUnlock();
+  }
+
+private:
+  struct alignas(kCachelineSize) PoolLock {
+    WRLock l;
+  };
+
+  pmem::obj::pool_base *pools;
+  PoolLock locks[kMaxNumaCnt];
+  std::vector<LogSegment *> free_list[kMaxNumaCnt];
+};
+
+// Log-structured NAL: instead of updating one slot per key in place (SPView),
+// every thread appends (key index, version, value) records to its own
+// segment on its own NUMA node, so that PM sees sequential writes only.
+// Segments come from ``seg_pool``, of the Nap instance.
+class LogView {
+public:
+  LogView(const std::vector<std::pair<std::string, WhereIsData>> &list,
+          LogSegmentPool *seg_pool)
+      : seg_pool(seg_pool), size(list.size()) {
+
+    memset(thread_logs, 0, sizeof(thread_logs));
+
+    record = nullptr;
+    keys = nullptr;
+    if (list.empty()) {
+      return;
+    }
+
+    size_t key_total_length = 0;
+    for (size_t i = 0; i < list.size(); ++i) {
+      key_total_length += list[i].first.size();
+    }
+
+    // keys are kept once, on node 0, for replay:
+    // | ViewRecord | LogKey * size | key bytes |
+    size_t bytes =
+        sizeof(ViewRecord) + size * sizeof(LogKey) + key_total_length;
+    PMEMoid oid;
+    if (pmemobj_zalloc(seg_pool->pool_at(0)->handle(), &oid, bytes, 0)) {
+      fprintf(stderr, "fail to alloc nvm for NAL keys\n");
+      exit(-1);
+    }
+    record = (ViewRecord *)pmemobj_direct(oid);
+    record->nal_mode = NAL_LOG;
+    record->key_cnt = size;
+    keys = (LogKey *)(record + 1);
+
+    uint32_t off = 0;
+    auto key_bytes = (char *)(keys + size);
+    for (size_t i = 0; i < size; ++i) {
+      auto k_len = list[i].first.size();
+      keys[i].off = off;
+      keys[i].k_size = k_len;
+      memcpy(key_bytes + off, list[i].first.c_str(), k_len);
+      off += k_len;
+    }
+    persistent::clflush_range(record, bytes);
+  }
+
+  // replay the records of the view recorded at ``rec`` by a previous run of
+  // the pools into the raw index: the newest record of each key, found by
+  // following the segments of every thread. Returns the number of keys
+  // written back.
+  template <class T>
+  static size_t recover(ViewRecord *rec, T *raw_index) {
+    auto *keys = (LogKey *)(rec + 1);
+    auto key_bytes = (char *)(keys + rec->key_cnt);
+    std::vector<LogRecord *> newest(rec->key_cnt, nullptr);
+
+    for (int t = 0; t < kMaxThreadCnt; ++t) {
+      for (auto oid = rec->heads[t]; !OID_IS_NULL(oid);) {
+        auto *seg = segment_of(oid);
+        size_t offset = 0;
+        while (offset + sizeof(LogRecord) <= LogSegment::capacity()) {
+          auto *r = (LogRecord *)(seg->data() + offset);
+          if (r->gen != (uint16_t)seg->gen) {
+            break; // end of the segment's log
+          }
+          auto len = LogRecord::length(r->is_deleted() ? 0 : r->size);
+          if (r->index >= rec->key_cnt ||
+              offset + len > LogSegment::capacity()) {
+            break; // not a record of this view, ``append`` never wrote it
+          }
+          auto &n = newest[r->index];
+          if (n == nullptr || r->version > n->version) {
+            n = r;
+          }
+          offset = LogRecord::header_at(offset + len);
+        }
+        oid = seg->prev;
+      }
+    }
+
+    std::vector<Slice> tombstones;
+    KVBatch batch;
+    size_t cnt = 0;
+    for (size_t i = 0; i < rec->key_cnt; ++i) {
+      auto *r = newest[i];
+      if (r == nullptr) {
+        continue;
+      }
+      Slice key(key_bytes + keys[i].off, keys[i].k_size);
+      if (r->is_deleted()) {
+        tombstones.push_back(key);
+      } else {
+        batch.emplace_back(key, Slice(r->value(), r->size));
+      }
+      cnt++;
+    }
+    flush_puts(raw_index, batch);
+    flush_deletes(raw_index, tombstones);
+    return cnt;
+  }
+
+  // where the view is recorded, OID_NULL if it is empty
+  PMEMoid record_oid() {
+    return record ? pmemobj_oid(record) : OID_NULL;
+  }
+
+  ~LogView() {
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      for (auto seg : segments[k]) {
+        seg_pool->put(k, seg);
+      }
+    }
+
+    if (record) {
+      PMEMoid oid = pmemobj_oid(record);
+      pmemobj_free(&oid);
+    }
+  }
+
+  // append a record to the log of the calling thread, return its address.
+  char *append(int index, const Slice &key, const Slice &value,
+               uint64_t new_version, bool is_del = false) {
+
+    uint64_t v = new_version;
+
+    auto value_size = is_del ? 0 : value.size();
+    auto len = LogRecord::length(value_size);
+    assert(value_size < LogRecord::kTombstone);
+
+    auto &tl = thread_logs[Topology::threadID()];
+    auto at = LogRecord::header_at(tl.offset);
+    if (tl.seg == nullptr || at + len > LogSegment::capacity()) {
+      new_segment(tl);
+      at = 0;
+    }
+
+    auto *data = tl.seg->data();
+    auto *r = (LogRecord *)(data + at);
+
+    // value first, with the next header cleared, so that the log of the
+    // segment ends exactly after this record; then the header which
+    // carries the segment gen
+    if (value_size) {
+      memcpy(r->value(), value.data(), value_size);
+    }
+    auto next = LogRecord::header_at(at + len);
+    auto end = std::min(next + sizeof(LogRecord), LogSegment::capacity());
+    if (next + sizeof(LogRecord) <= LogSegment::capacity()) {
+      memset(data + next, 0, sizeof(LogRecord));
+    }
+    if (end > at + sizeof(LogRecord)) {
+      persistent::clwb_range(r->value(), data + end - r->value());
+    }
+
+    r->index = index;
+    r->size = is_del ? LogRecord::kTombstone : value_size;
+    r->version = v;
+    compiler_barrier();
+    r->gen = (uint16_t)tl.seg->gen;
+    persistent::clwb_range(r, sizeof(LogRecord));
+
+    tl.offset = at + len;
+
+    return (char *)r;
+  }
+
+  // replay the newest record of each key, which the CN-view points to.
+  template <class T, class CN>
+  void flush_to_raw_index(T *raw_index, CN *cn, FlushPacer *pacer = nullptr) {
+    std::vector<Slice> tombstones;
+    KVBatch batch;
+    collect_dirty(cn, batch, tombstones);
+
+    flush_puts(raw_index, batch, pacer);
+    flush_deletes(raw_index, tombstones, pacer);
+  }
+
+  // the puts and deletes of a write-back: the newest record of each key
+  // of ``cn`` which has one
+  template <class CN>
+  void collect_dirty(CN *cn, KVBatch &batch, std::vector<Slice> &tombstones) {
+    for (auto &e : cn->view) {
+      auto *r = (LogRecord *)e.second.nal_ptr;
+      if (r == nullptr) {
+        continue;
+      }
+
+      auto key = key_at(r->index);
+      if (r->is_deleted()) {
+        tombstones.push_back(key);
+      } else {
+        batch.emplace_back(key, Slice(r->value(), r->size));
+      }
+    }
+  }
+
+private:
+  // offsets instead of pointers, the key buffer may be mapped elsewhere
+  struct __attribute__((__packed__)) LogKey {
+    uint32_t off; // from the end of the LogKey array
+    uint32_t k_size;
+  };
+
+  Slice key_at(int index) {
+    return Slice((char *)(keys + size) + keys[index].off, keys[index].k_size);
+  }
+
+  // the segment header of a segment allocation
+  static LogSegment *segment_of(PMEMoid oid) {
+    auto *ptr = (char *)pmemobj_direct(oid);
+    return (LogSegment *)(((uint64_t)ptr + kCachelineSize - 1) &
+                          (~(kCachelineSize - 1ull)));
+  }
+
+  struct alignas(kCachelineSize) ThreadLog {
+    LogSegment *seg;
+    size_t offset;
+  };
+
+  void new_segment(ThreadLog &tl) {
+    auto numa_id = Topology::numaID();
+    auto *seg = seg_pool->get(numa_id);
+    seg->prev = tl.seg ? tl.seg->oid : OID_NULL;
+    persistent::clflush(seg);
+
+    // the segment is reachable from the record before it holds any record
+    auto &head = record->heads[Topology::threadID()];
+    head = seg->oid;
+    persistent::clflush(&head);
+
+    tl.seg = seg;
+    tl.offset = 0;
+
+    seg_locks[numa_id].l.wLock();
+    segments[numa_id].push_back(tl.seg);
+    seg_locks[numa_id].l.wUnlock();
+  }
+
+  struct alignas(kCachelineSize) SegLock {
+    WRLock l;
+  };
+
+  LogSegmentPool *seg_pool;
+  size_t size;
+  ViewRecord *record; // head of the key buffer
+  LogKey *keys;
+
+  ThreadLog thread_logs[kMaxThreadCnt];
+
+  SegLock seg_locks[kMaxNumaCnt];
+  std::vector<LogSegment *> segments[kMaxNumaCnt];
+};
+
+} // namespace nap
+
+#endif // _NAL_LOG_H_
@@ -1,31 +1,93 @@
 #if !defined(_NAP_H_)
 #define _NAP_H_
 
+#include "blocked_count_min.h"
 #include "count_min_sketch.h"
+#include "flush_pacer.h"
+#include "hot_set_history.h"
 #include "nap_common.h"
 #include "nap_meta.h"
+#include "numa_aggregator.h"
+#include "shift_scheduler.h"
 #include "slice.h"
+#include "space_saving.h"
+#include "switch_model.h"
 #include "timer.h"
 #include "topology.h"
 
 #include <algorithm>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 namespace nap {
 
+// a raw index may tell the socket which holds the data of a key, -1 if it
+// does not know
+template <class I, class = void> struct HasNumaOf : std::false_type {};
+template <class I>
+struct HasNumaOf<I, std::void_t<decltype(std::declval<I &>().numa_of(
+                        std::declval<const Slice &>()))>> : std::true_type {};
+
 struct alignas(kCachelineSize) ThreadMeta {
   uint64_t epoch;
   uint64_t op_seq;
   uint64_t hit_in_cap;
   bool is_in_nap;
-
-  ThreadMeta() : epoch(0), op_seq(0), hit_in_cap(0), is_in_nap(false) {}
+  // the current operation waited for a switch to finish; its latency is
+  // the switch's, not the flush's, and is left out of the histogram
+  bool waited_switch;
+
+  // estimation of PM write amplification: NAL writes of this thread, the
+  // bytes they asked for, and how many of them open a different XPLine
+  // than the previous one.
+  uint64_t nal_writes;
+  uint64_t nal_bytes;
+  uint64_t xpline_writes;
+  uint64_t last_xpline;
+
+  // sampled latencies of operations, read by the shift thread while pacing
+  // a write-back
+  LatencyHistogram latency;
+
+  ThreadMeta()
+      : epoch(0), op_seq(0), hit_in_cap(0), is_in_nap(false),
+        waited_switch(false), nal_writes(0), nal_bytes(0), xpline_writes(0),
+        last_xpline(0) {}
+
+  void account_nal_write(void *addr, size_t bytes) {
+    uint64_t xpline = (uint64_t)addr / kXPLineSize;
+    nal_writes++;
+    nal_bytes += bytes;
+    if (xpline != last_xpline) {
+      xpline_writes++;
+      last_xpline = xpline;
+    }
+  }
 };
 
-extern pmem::obj::pool_base pop_numa[kMaxNumaCnt];
-extern ThreadMeta thread_meta_array[kMaxThreadCnt];
+// times one operation in kLatencySampleInterval into the thread histogram
+class LatencySample {
+public:
+  constexpr static uint64_t kLatencySampleInterval = 64;
+
+  LatencySample(ThreadMeta &m, bool on)
+      : m(m), begin(on && m.op_seq % kLatencySampleInterval == 0
+                        ? Timer::get_time_ns()
+                        : 0) {}
+
+  ~LatencySample() {
+    if (begin && !m.waited_switch) {
+      m.latency.add(Timer::get_time_ns() - begin);
+    }
+    m.waited_switch = false;
+  }
+
+private:
+  ThreadMeta &m;
+  uint64_t begin;
+};
 
 enum UndoLogType {
   Invalid,
@@ -33,15 +95,16 @@ enum UndoLogType {
   TYPE_2,
 };
 
+// the views a switch is about to replace in the root (ViewRecords)
 struct alignas(64) UndoLog {
   UndoLogType type;
-  void *cur;
-  void *pre;
-  void *gc;
+  PMEMoid cur;
+  PMEMoid pre;
+  PMEMoid gc;
 
   UndoLog() { type = UndoLogType::Invalid; }
 
-  void logging_type1(void *cur_, void *pre_) {
+  void logging_type1(PMEMoid cur_, PMEMoid pre_) {
     cur = cur_;
     pre = pre_;
     compiler_barrier();
@@ -49,7 +112,7 @@ struct alignas(64) UndoLog {
     persistent::clflush(this);
   }
 
-  void logging_type2(void *gc_, void *pre_) {
+  void logging_type2(PMEMoid gc_, PMEMoid pre_) {
     gc = gc_;
     pre = pre_;
     compiler_barrier();
@@ -63,26 +126,139 @@ struct alignas(64) UndoLog {
   }
 };
 
-template <class T> class Nap {
+// root object of the pool on node 0 of a Nap instance, found again when
+// the pools are reopened. A switch logs the views it replaces, updates
+// them here and truncates the log before it publishes the new view, so
+// that a view written by foreground threads is always reachable.
+struct alignas(kCachelineSize) NapRoot {
+  constexpr static uint64_t kMagic = 0x4e41505f524f4f54; // "NAP_ROOT"
+
+  uint64_t magic;
+  uint64_t boot;  // opens of the pools, also the epoch of GLOBAL_VERSION
+  uint64_t clean; // the views were written back by a clean shutdown
+  uint64_t pool_size;
+  uint64_t base[kMaxNumaCnt]; // where the pools were mapped, per node
+  PMEMoid cur, pre, gc;       // records of the live views
+  UndoLog undo_log;
+};
+
+template <class T> class Nap : public ShiftTask {
 
 private:
   T *raw_index;
 
-  CountMin *CM;
+  HotSetDetector *CM;
   int hot_cnt;
+  NalMode nal_mode;
+  DetectorKind detector;
+
+  // drain the rings of remote sockets on those sockets (NumaAggregator)
+  bool numa_aggregation{false};
+  NumaAggregator aggregator;
+  SlotLayout slot_layout{SLOT_SHUFFLED};
+
+  // rank hot keys by remote accesses they save instead of by frequency,
+  // out of kLocalityCandidates times as many candidates.
+  bool locality_aware{false};
+  constexpr static int kLocalityCandidates = 2;
+
+  // read-mostly hot keys become DRAM-only entries without a PC-view slot,
+  // so hot_cnt slots cover kReadOnlyCandidates times as many hot keys.
+  bool read_only_entries{false};
+  constexpr static int kReadOnlyCandidates = 4;
+  constexpr static int kReadMostlyWritePct = 1;
+
+  SwitchModel switch_model;
+  IntervalTuner interval_tuner;
+
+  bool hit_ratio_dropped(uint64_t &ops, uint64_t &hits, uint64_t begin_ns);
+
+  // hot sets which recur at a steady period are pre-built ahead of time,
+  // a switch to them is a pointer flip once their keys show up.
+  bool predictive{false};
+  HotSetHistory history;
+  NapMeta *prebuilt{nullptr};
+  HotSetHistory::HotSet prebuilt_set;
+  uint64_t prebuilt_epoch{0};
+  uint64_t prebuilt_kept{0};
+  uint64_t prebuilt_expire_ns{0};
+  uint64_t predicted_switches{0};
+
+  constexpr static int kPrebuildLeadWindows = 2;
+  constexpr static size_t kPredictSample = 256;
+  constexpr static double kPredictMatch = 0.6;
+  constexpr static uint64_t kPredictCheckNs = 100ull * 1000 * 1000;
+
+  void prebuild_predicted(const std::vector<NapPair> &cur_list,
+                          double window);
+  bool predicted_burst(const std::vector<NapPair> &cur_list);
+
+  // pacing of the switch write-back, and the foreground latency it costs
+  FlushPacer flush_pacer;
+  bool latency_sampling{false};
+  uint64_t latency_seen[LatencyHistogram::kBuckets]{};
+
+  uint64_t foreground_p99();
+
+  // write-back of NAL slots whose keys cooled down during the window, run
+  // in the shift thread's idle time, so that the switch has less to flush.
+  // One pass over the PC-view per window, from its second half on.
+  bool trickle{false};
+  NapMeta *trickle_meta{nullptr};
+  size_t trickle_cursor{0};
+  uint64_t trickle_from_ns{0};
+  uint64_t trickle_written{0};
+
+  constexpr static size_t kTrickleBatch = 64;
+
+  void trickle_in_idle();
 
   int kSampleInterval{1};
   double kSwitchInterval{5.0};
 
-  // In PM
+  // per-thread state, by the process-wide Topology::threadID
+  ThreadMeta *thread_meta_array;
+
+  // pools of this instance, created at ``pool_path`` with its one %d
+  // replaced by the NUMA node
+  std::string pool_path;
+  size_t pool_size;
+  NapPmem pm;
+
+  // recorded in ``root``
   NapMeta *g_cur_meta;
   NapMeta *g_pre_meta;
   NapMeta *g_gc_meta;
 
+  NapRoot *root;
   UndoLog *undo_log;
+  VersionClock version_clock; // of GLOBAL_VERSION, seeded by ``root``
+  uint64_t recovery_ns{0};
+
+  void recover(NapRoot *old_root);
 
 #ifndef FIX_8_BYTE_VALUE
-  CowMeta cow_meta[kMaxThreadCnt];
+  CowMeta cow_meta[kMaxThreadCnt + kMaxNumaCnt];
+
+  // online compaction of sparse CoW slab pages, run in the shift thread's
+  // idle time: select -> relocate (in slices) -> release.
+  enum CompactPhase {
+    COMPACT_SELECT,
+    COMPACT_RELOCATE,
+    COMPACT_RELEASE,
+  };
+  CompactPhase compact_phase{COMPACT_SELECT};
+  NapMeta *compact_meta{nullptr};
+  size_t compact_cursor{0};
+  uint64_t compact_ts{0};
+  uint64_t compact_relocated{0};
+  uint64_t compact_released{0};
+
+  double kCompactSparseRatio{0.25};
+  size_t kCompactBatch{1024};
+  uint64_t kCompactPeriodNs{1000ull * 1000 * 1000};
+
+  void compact_in_idle();
 #endif
 
   std::atomic<uint64_t> g_cur_epoch;
@@ -92,20 +268,90 @@ private:
 
   void init_pmdk_pool();
 
+  // the shift work: nap_shift runs it on a thread of its own, shift_step
+  // in slices on the shared thread (ShiftScheduler)
+  ShiftMode shift_mode;
+  std::vector<NapPair> cur_list; // the hot set switched to last
+
+  struct ShiftWindow {
+    bool open{false};
+    bool checked{false}; // whether ``window_cut_short`` is asked
+    bool burst{false};   // a predicted hot set showed up
+    double seconds{0};
+    uint64_t begin_ns{0};
+    uint64_t next_check_ns{0};
+    uint64_t next_predict_check_ns{0};
+    uint64_t ops{0}, hits{0};
+  } win;
+
+  // a switch in progress after ``end_window`` published the new view:
+  // wait for the threads to see it -> write back the old view (in slices)
+  // -> wait a grace period to free it. ``switch_step`` does one step.
+  enum SwitchPhase {
+    SWITCH_IDLE,
+    SWITCH_EPOCH_WAIT,
+    SWITCH_FLUSH,
+    SWITCH_GRACE,
+  };
+  struct SwitchState {
+    SwitchPhase phase{SWITCH_IDLE};
+    NapMeta *old_meta{nullptr};
+    size_t dirty_slots{0};
+    size_t kept_keys{0};
+    uint64_t p99_before{0};
+    uint64_t flush_ns{0};
+    KVBatch puts;
+    std::vector<Slice> dels;
+    size_t cursor{0};
+    uint64_t grace_seq[kMaxThreadCnt]{};
+  } sw;
+
+  size_t kSwitchSliceKeys{1024};
+
+  void shift_init();
   void nap_shift();
+  void begin_window();
+  bool window_cut_short();
+  void shift_idle_task();
+  void end_window(bool cut_short);
+  bool switch_step();
+  void end_flush();
+  HotSetDetector *new_detector(bool with_rings);
+
+  int home_numa_of(const Node &n);
+  void rank_by_remote_savings(std::vector<Node> &l);
+  bool is_read_mostly(const Node &n);
+  double expected_savings(const Node &n);
+  size_t select_hot_set(std::vector<Node> &l);
+  bool wait_for_slot(CNView::Entry *e, NapMeta *cur_meta, NapMeta *pre_meta);
+  void wait_switch_end(ThreadMeta &m);
 
   bool find_in_views(CNView::Entry *e, NapMeta *pre_meta, const Slice &key,
                      std::string &value);
 
-  void persist_meta_ptrs() { persistent::clflush(&g_cur_meta); }
+  void persist_views(NapMeta *cur, NapMeta *pre, NapMeta *gc) {
+    root->cur = cur ? cur->record_oid() : OID_NULL;
+    root->pre = pre ? pre->record_oid() : OID_NULL;
+    root->gc = gc ? gc->record_oid() : OID_NULL;
+    persistent::clwb_range(&root->cur, 3 * sizeof(PMEMoid));
+  }
 
   std::thread shift_thread;
   std::atomic_bool shift_thread_is_ready;
 
 public:
-  Nap(T *raw_index, int hot_cnt = kHotKeys);
+  // instances in one process need pools of their own, by ``pool_path``.
+  // Existing pools are reopened, and the views a crash left in them are
+  // written back into ``raw_index`` first, which must be recovered by then.
+  Nap(T *raw_index, int hot_cnt = kHotKeys, NalMode nal_mode = NAL_IN_PLACE,
+      DetectorKind detector = kDefaultDetector,
+      ShiftMode shift_mode = kDefaultShiftMode,
+      const std::string &pool_path = kDefaultPoolPath,
+      size_t pool_size = kDefaultPoolSize);
   ~Nap();
 
+  bool shift_step() override;
+
   void put(const Slice &key, const Slice &value, bool is_update = false);
 
   bool get(const Slice &key, std::string &value);
@@ -137,6 +383,9 @@ public:
 
   void recovery() { g_cur_meta->flush_sp_view(raw_index); }
 
+  // time the constructor took to write back the views of a previous run
+  uint64_t get_recovery_ns() { return recovery_ns; }
+
   void set_sampling_interval(int v) {
     kSampleInterval = v;
     mfence();
@@ -147,74 +396,307 @@ public:
     mfence();
   }
 
+  // let the shift thread pick the detection window within [min_s, max_s]
+  // by the measured drift, and end it early once the hit ratio is below
+  // ``hit_ratio_floor``. Takes effect from the next window.
+  void set_adaptive_switch_interval(double min_s, double max_s,
+                                    double hit_ratio_floor) {
+    interval_tuner.enable(min_s, max_s, hit_ratio_floor);
+    mfence();
+  }
+
+  // takes effect from the next switch
+  void set_slot_layout(SlotLayout layout) {
+    slot_layout = layout;
+    mfence();
+  }
+
+  // takes effect from the next switch
+  void set_locality_aware(bool on) {
+    locality_aware = on;
+    mfence();
+  }
+
+  // latency gap between a remote and a local raw-index access, used by the
+  // switch cost model
+  void set_remote_access_ns(double ns) {
+    switch_model.set_remote_access_ns(ns);
+  }
+
+  void set_switch_log(bool on) { switch_model.set_log(on); }
+
+  // cap the write-back of a switch at ``bytes_per_sec`` of raw index writes,
+  // 0 flushes at full speed. Takes effect from the next switch.
+  void set_flush_rate(uint64_t bytes_per_sec) {
+    flush_pacer.set_rate(bytes_per_sec);
+    latency_sampling = bytes_per_sec != 0;
+    mfence();
+  }
+
+  // lower the flush rate, down to ``min_bytes_per_sec``, while the sampled
+  // foreground p99 is above ``p99_ns``. Call after set_flush_rate.
+  void set_flush_latency_target(uint64_t p99_ns, uint64_t min_bytes_per_sec) {
+    flush_pacer.set_latency_target(p99_ns, min_bytes_per_sec,
+                                   [this] { return foreground_p99(); });
+  }
+
+  // pace a write-back for at most ``seconds``, 0 for no limit
+  void set_flush_max_time(double seconds) {
+    flush_pacer.set_max_flush_time(seconds * 1000 * 1000 * 1000);
+  }
+
+  // takes effect from the next window
+  void set_prediction(bool on) {
+    predictive = on;
+    mfence();
+  }
+
+  // takes effect from the next window; samples of remote sockets reach
+  // the detector at the end of the window only
+  void set_numa_aggregation(bool on) {
+    numa_aggregation = on;
+    mfence();
+  }
+
+  // takes effect from the next window, in-place NAL only
+  void set_trickle_write_back(bool on) {
+    trickle = on;
+    mfence();
+  }
+
+  // takes effect from the next switch, in-place NAL only
+  void set_read_only_entries(bool on) {
+    read_only_entries = on;
+    mfence();
+  }
+
+#ifndef FIX_8_BYTE_VALUE
+  // pages whose occupancy is at most ``ratio`` are compacted
+  void set_compaction(double ratio) {
+    kCompactSparseRatio = ratio;
+    mfence();
+  }
+
+  size_t pm_bytes() { return pm.cow_alloc->pm_bytes(); }
+#endif
+
   void clear() {
     for (int i = 0; i < kMaxThreadCnt; ++i) {
       thread_meta_array[i].op_seq = 0;
       thread_meta_array[i].hit_in_cap = 0;
+      thread_meta_array[i].nal_writes = 0;
+      thread_meta_array[i].nal_bytes = 0;
+      thread_meta_array[i].xpline_writes = 0;
     }
   }
 
   void show_statistics() {
     uint64_t all_op = 0;
     uint64_t all_hit = 0;
+    uint64_t all_nal_bytes = 0;
+    uint64_t all_xpline_writes = 0;
     for (int i = 0; i < kMaxThreadCnt; ++i) {
       all_op += thread_meta_array[i].op_seq;
       all_hit += thread_meta_array[i].hit_in_cap;
+      all_nal_bytes += thread_meta_array[i].nal_bytes;
+      all_xpline_writes += thread_meta_array[i].xpline_writes;
     }
     printf("nap hit ratio: %f\n", all_hit * 1.0 / all_op);
+    // media bytes (256B per opened XPLine) / bytes the NAL writes asked for
+    if (all_nal_bytes) {
+      printf("nap PM write amplification (est.): %f\n",
+             all_xpline_writes * kXPLineSize * 1.0 / all_nal_bytes);
+    }
+    if (predictive) {
+      printf("nap predicted switches: %lu\n", predicted_switches);
+    }
+    if (trickle) {
+      printf("nap trickle write-backs: %lu\n", trickle_written);
+    }
+#ifndef FIX_8_BYTE_VALUE
+    printf("nap compaction: %lu values relocated, %lu pages released, PM %lu "
+           "MB\n",
+           compact_relocated, compact_released, pm_bytes() / 1024 / 1024);
+#endif
   }
 };
 
 template <class T>
-Nap<T>::Nap(T *raw_index, int hot_cnt)
-    : raw_index(raw_index), hot_cnt(hot_cnt), shift_thread_is_ready(false) {
+Nap<T>::Nap(T *raw_index, int hot_cnt, NalMode nal_mode,
+            DetectorKind detector, ShiftMode shift_mode,
+            const std::string &pool_path, size_t pool_size)
+    : raw_index(raw_index), hot_cnt(hot_cnt), nal_mode(nal_mode),
+      detector(detector), thread_meta_array(new ThreadMeta[kMaxThreadCnt]),
+      pool_path(pool_path), pool_size(pool_size), shift_mode(shift_mode),
+      shift_thread_is_ready(false) {
 
   init_pmdk_pool();
 
-  {
-
-    // for switch thread
-    PMEMoid oid;
-    pmemobj_alloc(Topology::pmdk_pool()->handle(), &oid, sizeof(UndoLog), 0,
-                  nullptr, nullptr);
-    undo_log = (UndoLog *)pmemobj_direct(oid);
+#ifdef GLOBAL_VERSION
+  version_clock.set_boot_epoch(root->boot);
+#endif
 
+  {
 #ifndef FIX_8_BYTE_VALUE
     // for Cow alloctor
-
-    for (int k = 0; k < kMaxThreadCnt; ++k) {
-      pmemobj_alloc(Topology::pmdk_pool()->handle(), &oid, 1024 * 1024, 0,
-                    nullptr, nullptr);
+    PMEMoid oid;
+    auto &pop = pm.pools[Topology::numaID()];
+    for (int k = 0; k < kMaxThreadCnt + kMaxNumaCnt; ++k) {
+      pmemobj_alloc(pop.handle(), &oid, 1024 * 1024, 0, nullptr, nullptr);
       cow_meta[k].log = (char *)pmemobj_direct(oid);
     }
-    cow_alloc = new CowAlloctor(cow_meta);
+    pm.cow_alloc = new CowAlloctor(cow_meta, pm.pools);
 
 #endif
   }
 
+  if (shift_mode == SHIFT_SHARED) {
+    shift_init();
+    shift_scheduler.add(this);
+    return;
+  }
+
   shift_thread = std::thread(&Nap<T>::nap_shift, this);
 
   while (!shift_thread_is_ready)
     ;
 }
 
+// a clean shutdown: no foreground thread is in Nap any more
 template <class T> Nap<T>::~Nap() {
   shift_thread_is_ready.store(false);
 
-  shift_thread.join();
+  if (shift_mode == SHIFT_SHARED) {
+    shift_scheduler.remove(this);
+  } else {
+    shift_thread.join();
+  }
+  aggregator.stop(); // deletes the per-node detectors
+  delete prebuilt;
+
+  // finish a switch the shared thread left halfway
+  while (switch_step()) {
+  }
+  g_cur_meta->flush_sp_view(raw_index);
+  root->clean = 1;
+  persistent::clflush(&root->clean);
+
+  // the view returns its arrays and CoW values while the pools are open
+  delete g_cur_meta;
+  delete CM;
+  delete pm.cow_alloc;
+  delete[] thread_meta_array;
+
+  for (int i = 0; i < Topology::kNumaCnt; ++i) {
+    pm.pools[i].close();
+  }
 }
 
+// Opens the pools of a previous run if all of them are there, writes back
+// the views left in them, then recreates the pools: they hold nothing but
+// the NAL, which is in the raw index from now on.
 template <class T> void Nap<T>::init_pmdk_pool() {
+  // one file per node: a path without %d would give all of them the same
+  auto pos = pool_path.find("%d");
+  if (pos == std::string::npos ||
+      std::count(pool_path.begin(), pool_path.end(), '%') != 1) {
+    fprintf(stderr, "nap pool path %s needs exactly one %%d for the node\n",
+            pool_path.c_str());
+    exit(-1);
+  }
+
+  std::string pool_name[kMaxNumaCnt];
+  int opened = 0;
+  for (int i = 0; i < Topology::kNumaCnt; ++i) {
+    pool_name[i] = pool_path.substr(0, pos) + std::to_string(i) +
+                   pool_path.substr(pos + 2);
+    printf("nap %d pool: %s\n", i, pool_name[i].c_str());
+
+    if (opened == i && access(pool_name[i].c_str(), F_OK) == 0) {
+      try {
+        pm.pools[i] = pmem::obj::pool<int>::open(pool_name[i], "nap");
+        opened++;
+      } catch (pmem::pool_error &e) {
+        printf("nap %d pool: %s, not recovered\n", i, e.what());
+      }
+    }
+  }
 
-  // init per-NUMA PMDK pool
+  uint64_t boot = 0;
+  if (opened == Topology::kNumaCnt) {
+    auto *old_root = (NapRoot *)pmemobj_direct(
+        pmemobj_root(pm.pools[0].handle(), sizeof(NapRoot)));
+    if (old_root->magic == NapRoot::kMagic) {
+      boot = old_root->boot;
+      recover(old_root);
+    }
+  }
+  for (int i = 0; i < opened; ++i) {
+    pm.pools[i].close();
+  }
+
+  for (int i = 0; i < Topology::kNumaCnt; ++i) {
+    remove(pool_name[i].c_str());
+    pm.pools[i] = pmem::obj::pool<int>::create(pool_name[i], "nap", pool_size,
+                                               S_IWUSR | S_IRUSR);
+  }
+
+  root = (NapRoot *)pmemobj_direct(
+      pmemobj_root(pm.pools[0].handle(), sizeof(NapRoot)));
+  root->boot = boot + 1;
+  root->clean = 0;
+  root->pool_size = pool_size;
   for (int i = 0; i < Topology::kNumaCnt; ++i) {
-    std::string pool_name = std::string("/mnt/pmem") + std::to_string(i) + "/nap";
-    printf("nap %d pool: %s\n", i, pool_name.c_str());
+    root->base[i] = (uint64_t)pm.pools[i].handle();
+  }
+  root->cur = root->pre = root->gc = OID_NULL;
+  undo_log = &root->undo_log;
+  undo_log->type = UndoLogType::Invalid;
+  persistent::clflush_range(root, sizeof(NapRoot));
+
+  root->magic = NapRoot::kMagic;
+  persistent::clflush(&root->magic);
+}
 
-    remove(pool_name.c_str());
-    nap_pop_numa[i] = pmem::obj::pool<int>::create(
-        pool_name, "nap", PMEMOBJ_MIN_POOL * 1024 * 2, S_IWUSR | S_IRUSR);
+// roll back a switch the crash interrupted, then write back the views
+// which may hold values the raw index does not have, oldest first. The
+// view of ``gc`` is written back already.
+template <class T> void Nap<T>::recover(NapRoot *old_root) {
+  if (old_root->clean) {
+    printf("nap recovery: clean shutdown, nothing to write back\n");
+    return;
   }
+
+  Timer timer;
+  timer.begin();
+
+  auto cur = old_root->cur;
+  auto pre = old_root->pre;
+  auto &log = old_root->undo_log;
+  if (log.type == UndoLogType::TYPE_1) {
+    cur = log.cur;
+    pre = log.pre;
+  } else if (log.type == UndoLogType::TYPE_2) {
+    pre = log.pre;
+  }
+
+  // CoW values were addressed in the mappings of the previous run
+  auto translate = [&](char *p) -> char * {
+    for (int i = 0; i < Topology::kNumaCnt; ++i) {
+      uint64_t off = (uint64_t)p - old_root->base[i];
+      if (off < old_root->pool_size) {
+        return (char *)pm.pools[i].handle() + off;
+      }
+    }
+    return nullptr;
+  };
+
+  size_t keys = NapMeta::recover(pre, raw_index, translate);
+  keys += NapMeta::recover(cur, raw_index, translate);
+
+  recovery_ns = timer.end();
+  printf("nap recovery: %lu keys written back in %.1f ms (undo log %d)\n",
+         keys, recovery_ns / 1e6, (int)log.type);
 }
 
 template <class T>
@@ -230,11 +712,12 @@ void Nap<T>::put(const Slice &key, const Slice &value, bool is_update) {
   uint64_t version, next_version, cur_epoch;
   thread_meta.is_in_nap = true;
   thread_meta.op_seq++;
+  LatencySample latency_sample(thread_meta, latency_sampling);
    
 
   // sampling and publish access pattern
   if (thread_meta.op_seq % kSampleInterval == 0) {
-    CM->record(key);
+    CM->record(key, true);
   }
 
 retry:
@@ -267,7 +750,10 @@ retry:
 
     bool is_writer = false;
 
-    auto alloc_ptr = cur_meta->sp_view->alloc_before_update(key, value);
+    // DRAM-only entries allocate once they own a slot
+    auto alloc_ptr = e->sp_view_index == -1
+                         ? nullptr
+                         : cur_meta->alloc_before_update(key, value);
 
   re_lock:
     if (!e->l.try_putLock(is_writer)) {
@@ -288,23 +774,30 @@ retry:
       goto retry;
     }
 
+    if (e->sp_view_index == -1 && !wait_for_slot(e, cur_meta, pre_meta)) {
+      goto retry;
+    }
+
     if (e->location == WhereIsData::IN_PREVIOUS_EPOCH) { //
       CNView::Entry *pre_e;
       if (pre_meta->cn_view->get_entry(key, pre_e)) {
         pre_e->l.wLock();
         pre_e->shifting = true;
+        e->version = std::max(e->version, pre_e->version);
         pre_e->l.wUnlock();
       } else {
         assert(false);
       }
     }
 
-#ifdef GLOBAL_VERSION
-    cur_meta->sp_view->update(e->sp_view_index, alloc_ptr, key, value, 1);
-#else
-    cur_meta->sp_view->update(e->sp_view_index, alloc_ptr, key, value,
-                              e->next_version());
-#endif
+    if (e->sp_view_index == -1) { // no spare slot left
+      raw_index->put(key, value, is_update);
+    } else {
+      cur_meta->update(e, alloc_ptr, key, value,
+                       e->next_version(version_clock));
+      thread_meta.account_nal_write(cur_meta->last_write_addr(e),
+                                    cur_meta->write_bytes(value.size()));
+    }
 
     e->v = value.ToString();
     e->is_deleted = false;
@@ -316,11 +809,7 @@ retry:
     e->l.putUnlock();
   } else if (pre_meta) {
     if (pre_meta->cn_view->get_entry(key, e)) { // in the pre_meta
-      thread_meta.is_in_nap = false;
-      while (g_pre_meta != nullptr) {
-        mfence();
-      }
-      thread_meta.is_in_nap = true;
+      wait_switch_end(thread_meta);
       goto retry;
     } else {
       raw_index->put(key, value, is_update);
@@ -354,6 +843,7 @@ template <class T> bool Nap<T>::get(const Slice &key, std::string &value) {
   auto &thread_meta = thread_meta_array[Topology::threadID()];
   thread_meta.is_in_nap = true;
   thread_meta.op_seq++;
+  LatencySample latency_sample(thread_meta, latency_sampling);
   
    // sampling and publish access pattern
   if (thread_meta.op_seq % kSampleInterval == 0) {
@@ -448,6 +938,7 @@ retry:
       pre_e->l.wLock();
       pre_e->shifting = true;
       e->location = WhereIsData::IN_CURRENT_EPOCH;
+      e->version = std::max(e->version, pre_e->version);
       if (pre_e->location == WhereIsData::IN_CURRENT_EPOCH) {
         e->is_deleted = pre_e->is_deleted;
         e->v = pre_e->v;
@@ -517,9 +1008,10 @@ template <class T> void Nap<T>::del(const Slice &key) {
   uint64_t version, next_version, cur_epoch;
   thread_meta.is_in_nap = true;
   thread_meta.op_seq++;
+  LatencySample latency_sample(thread_meta, latency_sampling);
 
   if (thread_meta.op_seq % kSampleInterval == 0) {
-    CM->record(key);
+    CM->record(key, true);
   }
 
 retry:
@@ -557,23 +1049,30 @@ retry:
       goto retry;
     }
 
+    if (e->sp_view_index == -1 && !wait_for_slot(e, cur_meta, pre_meta)) {
+      goto retry;
+    }
+
     if (e->location == WhereIsData::IN_PREVIOUS_EPOCH) { //
       CNView::Entry *pre_e;
       if (pre_meta->cn_view->get_entry(key, pre_e)) {
         pre_e->l.wLock();
         pre_e->shifting = true;
+        e->version = std::max(e->version, pre_e->version);
         pre_e->l.wUnlock();
       } else {
         assert(false);
       }
     }
 
-#ifdef GLOBAL_VERSION
-    cur_meta->sp_view->update(e->sp_view_index, nullptr, key, value, 1, true);
-#else
-    cur_meta->sp_view->update(e->sp_view_index, nullptr, key, value,
-                              e->next_version(), true);
-#endif
+    if (e->sp_view_index == -1) { // no spare slot left
+      raw_index->del(key);
+    } else {
+      cur_meta->update(e, nullptr, key, value, e->next_version(version_clock),
+                       true);
+      thread_meta.account_nal_write(cur_meta->last_write_addr(e),
+                                    cur_meta->write_bytes(0));
+    }
 
     e->is_deleted = true;
 
@@ -584,11 +1083,7 @@ retry:
     e->l.putUnlock();
   } else if (pre_meta) {
     if (pre_meta->cn_view->get_entry(key, e)) {
-      thread_meta.is_in_nap = false;
-      while (g_pre_meta != nullptr) {
-        mfence();
-      }
-      thread_meta.is_in_nap = true;
+      wait_switch_end(thread_meta);
       goto retry;
     } else {
       raw_index->del(key);
@@ -623,79 +1118,205 @@ void Nap<T>::range_query(const Slice &key, size_t count,
   // use ``internal_query`` for evaluation.
 }
 
-template <class T> void Nap<T>::nap_shift() {
-
-  static auto sort_func = [](const NapPair &a, const NapPair &b) {
-    return a.first < b.first;
-  };
-
-  bindCore(Topology::threadID());
+template <class T> HotSetDetector *Nap<T>::new_detector(bool with_rings) {
+  if (detector == DETECTOR_SPACE_SAVING) {
+    return new SpaceSaving(hot_cnt, with_rings);
+  } else if (detector == DETECTOR_BLOCKED_COUNT_MIN) {
+    return new BlockedCountMin(hot_cnt, with_rings);
+  }
+  return new CountMin(hot_cnt, with_rings);
+}
 
-  CM = new CountMin(hot_cnt);
+template <class T> void Nap<T>::shift_init() {
+  CM = new_detector(true);
 
   g_cur_epoch = 1;
   epoch_seq_lock = 0;
   g_cur_meta = g_pre_meta = g_gc_meta = nullptr;
 
-  std::vector<NapPair> cur_list;
-  g_cur_meta = new NapMeta(cur_list);
+  cur_list.clear();
+  g_cur_meta = new NapMeta(pm, cur_list, nal_mode);
+  persist_views(g_cur_meta, nullptr, nullptr);
 
   shift_thread_is_ready.store(true);
+}
+
+template <class T> void Nap<T>::nap_shift() {
+
+  bindCore(Topology::threadID());
+
+  shift_init();
 
   printf("shift thread finished init [%d].\n", Topology::threadID());
 
-  const int kPreHotest = 8;
-  std::string pre_hotest_keys[kPreHotest];
   while (shift_thread_is_ready) {
+    begin_window();
 
-    CM->reset(); // clear min-count sketch and min heap
-    CM->poll_workloads(kSwitchInterval /* seconds */);
+    std::function<bool()> stop = nullptr;
+    if (win.checked) {
+      stop = [this] { return window_cut_short(); };
+    }
+    auto idle_task = [this] { shift_idle_task(); };
+    bool cut_short = CM->poll_workloads(
+        win.seconds, idle_task, stop,
+        aggregator.is_running() ? aggregator.home_numa() : -1);
+    end_window(cut_short);
+    while (switch_step()) {
+    }
+  }
 
-    auto &l = CM->get_list();
+  printf("shift thread stopped.\n");
+}
 
-    std::sort(
-        l.begin() + 1, l.end(),
-        [](const nap::Node &a, const nap::Node &b) { return a.cnt > b.cnt; });
+template <class T> bool Nap<T>::shift_step() {
+  if (sw.phase != SWITCH_IDLE) {
+    switch_step();
+    return true;
+  }
+  if (!win.open) {
+    begin_window();
+  }
 
-    if (l.size() <= kPreHotest || l[1].cnt < 100) { // not need shift
-      continue;
-    }
+  bool busy = CM->poll_round(
+      aggregator.is_running() ? aggregator.home_numa() : -1);
+  if (!busy) {
+    shift_idle_task();
+  }
+
+  auto now = Timer::get_time_ns();
+  bool cut_short = false;
+  if (win.checked && now >= win.next_check_ns) {
+    win.next_check_ns = now + HotSetDetector::kStopCheckNs;
+    cut_short = window_cut_short();
+  }
+  if (cut_short ||
+      now - win.begin_ns > win.seconds * (1000ull * 1000 * 1000)) {
+    end_window(cut_short);
+    return true;
+  }
+  return busy;
+}
 
-    if (l[1].cnt / l.back().cnt < 3) { // it is a uniform workload
-      continue;
+template <class T> void Nap<T>::begin_window() {
+  if (numa_aggregation != aggregator.is_running()) {
+    if (numa_aggregation) {
+      aggregator.start(CM, [this] { return new_detector(false); });
+    } else {
+      aggregator.stop();
     }
+  }
 
-    bool need_shift = true;
-    for (int i = 0; i < kPreHotest; ++i) {
-      if (l[1].key == pre_hotest_keys[i]) {
-        need_shift = false;
-        break;
-      }
+  int candidates =
+      hot_cnt * std::max(locality_aware ? kLocalityCandidates : 1,
+                         read_only_entries ? kReadOnlyCandidates : 1);
+  CM->set_candidates(candidates);
+  CM->reset(); // clear the detector
+  aggregator.set_candidates(candidates);
+  aggregator.reset();
+
+  win.seconds = interval_tuner.is_enabled() ? interval_tuner.get_window()
+                                            : kSwitchInterval;
+  prebuild_predicted(cur_list, win.seconds);
+
+  win.open = true;
+  win.burst = false;
+  win.begin_ns = Timer::get_time_ns();
+  win.next_check_ns = win.begin_ns + HotSetDetector::kStopCheckNs;
+  win.next_predict_check_ns = win.begin_ns;
+  win.checked = interval_tuner.is_enabled() || prebuilt;
+  if (win.checked) {
+    hit_ratio_dropped(win.ops, win.hits, 0); // start counting
+  }
+
+  trickle_cursor = 0;
+  trickle_from_ns = win.begin_ns + win.seconds * (1000ull * 1000 * 1000) / 2;
+}
+
+// whether the window ends early: a predicted hot set showed up, or the hit
+// ratio of the current one dropped
+template <class T> bool Nap<T>::window_cut_short() {
+  if (prebuilt && Timer::get_time_ns() > win.next_predict_check_ns) {
+    win.next_predict_check_ns = Timer::get_time_ns() + kPredictCheckNs;
+    if (predicted_burst(cur_list)) {
+      win.burst = true;
+      return true;
     }
+  }
+  return interval_tuner.is_enabled() &&
+         hit_ratio_dropped(win.ops, win.hits, win.begin_ns);
+}
 
-    if (!need_shift) {
-      continue;
+template <class T> void Nap<T>::shift_idle_task() {
+#ifndef FIX_8_BYTE_VALUE
+  compact_in_idle();
+#endif
+  trickle_in_idle();
+}
+
+// select the hot set of the window and switch to it if it pays off
+template <class T> void Nap<T>::end_window(bool cut_short) {
+  win.open = false;
+  bool burst = win.burst;
+  cut_short = cut_short && !burst;
+  aggregator.merge();
+
+  NapMeta *new_meta = nullptr;
+  std::vector<NapPair> new_list;
+  std::vector<uint32_t> write_freq;
+  std::vector<bool> dram_only;
+  size_t spare_slots = 0;
+  SwitchInput in;
+
+  if (burst) { // the pre-built hot set is here, no need to wait and see
+    new_meta = prebuilt;
+    prebuilt = nullptr;
+    new_list = std::move(prebuilt_set.list);
+    write_freq = std::move(prebuilt_set.write_freq);
+    dram_only = std::move(prebuilt_set.dram_only);
+    spare_slots = prebuilt_set.spare_slots;
+    in.dirty_slots = g_cur_meta->dirty_count();
+    in.kept_keys = prebuilt_kept;
+    predicted_switches++;
+    if (switch_model.log_enabled()) {
+      printf("nap switch decision [epoch %lu]: predicted hot set (%lu "
+             "keys) -> switch\n",
+             g_cur_epoch.load(), new_list.size());
+    }
+  } else {
+    auto &l = CM->get_list();
+    if (l.size() <= 1) {
+      return;
     }
 
+    std::sort(
+        l.begin() + 1, l.end(),
+        [](const nap::Node &a, const nap::Node &b) { return a.cnt > b.cnt; });
+
     // for (size_t i = 1; i < 10; ++i) {
     //   auto k = *(uint64_t *)(l[i].key.c_str());
     //   printf("%ld %d\n", k, l[i].cnt);
     // }
 
-#ifdef USE_GLOBAL_LOCK
-    shift_global_lock.write_lock();
-#endif
-
-    for (size_t i = 0; i < kPreHotest; ++i) {
-      pre_hotest_keys[i] = l[1 + i].key;
+    if (locality_aware) {
+      rank_by_remote_savings(l);
     }
+    size_t slot_cnt = select_hot_set(l);
+
+    std::sort(
+        l.begin() + 1, l.end(),
+        [](const nap::Node &a, const nap::Node &b) { return a.key < b.key; });
 
-    std::vector<NapPair> new_list;
+    std::vector<double> savings;
+    double min_savings = -1;
     for (uint64_t k = 1; k < l.size(); ++k) {
       new_list.push_back({l[k].key, WhereIsData::IN_RAW_INDEX});
+      write_freq.push_back(l[k].w_cnt);
+      dram_only.push_back(read_only_entries && is_read_mostly(l[k]));
+      savings.push_back(expected_savings(l[k]));
+      if (min_savings < 0 || savings.back() < min_savings) {
+        min_savings = savings.back();
+      }
     }
-    
-    std::sort(new_list.begin(), new_list.end(), sort_func);
 
     uint64_t overlapped_cnt = 0;
     for (size_t i = 0, j = 0; i < cur_list.size() && j < new_list.size();) {
@@ -711,103 +1332,484 @@ template <class T> void Nap<T>::nap_shift() {
       }
     }
 
-    if (overlapped_cnt > 0.75 * hot_cnt) { // not need shift
-      continue;
+    // keys joining the hot set gain their savings; keys leaving it fell out
+    // of the candidates, so they save at most what the coldest candidate does
+    in.gain = 0;
+    for (size_t j = 0; j < new_list.size(); ++j) {
+      if (new_list[j].second != WhereIsData::IN_PREVIOUS_EPOCH) {
+        in.gain += savings[j];
+      }
+    }
+    in.gain -=
+        (cur_list.size() - overlapped_cnt) * std::max(min_savings, 0.0);
+    in.sample_rate = kSampleInterval;
+    in.dirty_slots = g_cur_meta->dirty_count();
+    in.kept_keys = overlapped_cnt;
+    in.new_keys = new_list.size() - overlapped_cnt;
+
+    interval_tuner.on_window(
+        new_list.empty() ? 1.0 : overlapped_cnt * 1.0 / new_list.size(),
+        cut_short);
+
+    if (!switch_model.decide(g_cur_epoch, in, cut_short)) {
+      return;
     }
 
-    auto new_meta = new NapMeta(new_list);
-    auto old_meta = g_cur_meta;
+    // the slot budget left by write-hot keys is kept for promotions
+    spare_slots = hot_cnt - std::min(slot_cnt, (size_t)hot_cnt);
+  }
 
-    cur_list.swap(new_list);
+#ifdef USE_GLOBAL_LOCK
+  shift_global_lock.write_lock();
+#endif
 
-    undo_log->logging_type1(g_cur_meta, g_pre_meta); // undo logging
-    data_race_lock.write_lock();
-    epoch_seq_lock.fetch_add(1); 
-    g_cur_meta = new_meta;
-    // sleep(1);
-    g_pre_meta = old_meta;
-    // sleep(1);
-    g_cur_epoch++;
-    epoch_seq_lock.fetch_add(1);
-    data_race_lock.write_unlock();
+  if (new_meta == nullptr) {
+    new_meta = new NapMeta(pm, new_list, nal_mode, slot_layout, &write_freq,
+                           &dram_only, spare_slots);
+  }
+  auto old_meta = g_cur_meta;
 
-    persist_meta_ptrs();
-    undo_log->truncate();
+  if (predictive) {
+    history.record({new_list, write_freq, dram_only, spare_slots},
+                   Timer::get_time_ns());
+  }
 
-    // Timer timer;
-    // timer.begin();
+  cur_list.swap(new_list);
+
+  // undo logging, the root names the new view before anyone writes it
+  undo_log->logging_type1(g_cur_meta->record_oid(),
+                          g_pre_meta ? g_pre_meta->record_oid() : OID_NULL);
+  persist_views(new_meta, old_meta, g_gc_meta);
+  undo_log->truncate();
+
+  data_race_lock.write_lock();
+  epoch_seq_lock.fetch_add(1); 
+  g_cur_meta = new_meta;
+  // sleep(1);
+  g_pre_meta = old_meta;
+  // sleep(1);
+  g_cur_epoch++;
+  epoch_seq_lock.fetch_add(1);
+  data_race_lock.write_unlock();
+
+  // printf("new epoch %ld {%p}\n", g_cur_epoch.load(), g_cur_meta->sp_view);
+
+  sw.old_meta = old_meta;
+  sw.dirty_slots = in.dirty_slots;
+  sw.kept_keys = in.kept_keys;
+  sw.phase = SWITCH_EPOCH_WAIT;
+}
 
-    // printf("new epoch %ld {%p}\n", g_cur_epoch.load(), g_cur_meta->sp_view);
+// one bounded step of the switch in progress, so that the shared shift
+// thread goes on with other instances meanwhile. Returns false if there
+// is no switch in progress.
+template <class T> bool Nap<T>::switch_step() {
+  switch (sw.phase) {
+  case SWITCH_IDLE:
+    return false;
 
+  case SWITCH_EPOCH_WAIT:
     // wait util all threads learn that a shifting is ongoing.
     for (int i = 0; i < kMaxThreadCnt; ++i) {
       auto &m = thread_meta_array[i];
-      while (m.epoch != g_cur_epoch && m.is_in_nap) {
+      if (m.epoch != g_cur_epoch && m.is_in_nap) {
         mfence();
+        return true;
       }
     }
 
-    // timer.end_print(1);
-    // timer.begin();
+    if (flush_pacer.is_enabled()) {
+      sw.p99_before = foreground_p99(); // over the detection window
+      flush_pacer.begin();
+    }
+    sw.old_meta->collect_write_back(raw_index, sw.puts, sw.dels);
+    sw.cursor = 0;
+    sw.flush_ns = 0;
+    sw.phase = SWITCH_FLUSH;
+    return true;
+
+  case SWITCH_FLUSH: {
+    // flush the NAL into raw index
+    Timer cost_timer;
+    cost_timer.begin();
+    auto *pacer = flush_pacer.is_enabled() ? &flush_pacer : nullptr;
+    bool done = flush_slice(raw_index, sw.puts, sw.dels, sw.cursor,
+                            kSwitchSliceKeys, pacer);
+    sw.flush_ns += cost_timer.end();
+    if (done) {
+      end_flush();
+    }
+    return true;
+  }
 
-    // printf("epoch %ld flush sp view\n", g_cur_epoch.load());
-    old_meta->flush_sp_view<T>(raw_index); // flush the NAL into raw index
+  case SWITCH_GRACE:
+    // wait a grace period period for safe dealloction.
+    for (int i = 0; i < kMaxThreadCnt; ++i) {
+      auto &m = thread_meta_array[i];
+      if (m.is_in_nap && m.op_seq == sw.grace_seq[i]) {
+        mfence();
+        return true;
+      }
+    }
 
-    // timer.end_print(1);
-    // timer.begin();
+    persist_views(g_cur_meta, nullptr, nullptr);
+    delete sw.old_meta;
+    sw.old_meta = nullptr;
+    g_gc_meta = nullptr;
+    sw.phase = SWITCH_IDLE;
 
-    // printf("epoch %ld relocate_value\n", g_cur_epoch.load());
-    new_meta->relocate_value(old_meta); // finish lazy initialization
+#ifdef USE_GLOBAL_LOCK
+    shift_global_lock.write_unlock();
+#endif
+    // printf("delete meta of epoch %ld safely\n", g_cur_epoch - 1);
+    return true;
+  }
+  return false;
+}
 
-    // timer.end_print(1);
-    // timer.begin();
+// the old view is written back: finish lazy initialization of the new one
+// and retire the old one
+template <class T> void Nap<T>::end_flush() {
+  auto flush_ns = sw.flush_ns;
+  if (flush_pacer.is_enabled()) {
+    auto p99_during = foreground_p99();
+    printf("nap switch flush [epoch %lu]: %lu KB in %.1f ms (%.1f ms "
+           "paced, rate %lu MB/s), foreground p99 %lu ns (worst %lu ns) vs "
+           "%lu ns before\n",
+           g_cur_epoch.load(), flush_pacer.get_bytes() / 1024,
+           flush_ns / 1e6, flush_pacer.get_waited_ns() / 1e6,
+           flush_pacer.get_rate() / 1024 / 1024, p99_during,
+           std::max(p99_during, flush_pacer.get_worst_p99()),
+           sw.p99_before);
+    flush_ns -= std::min(flush_ns, flush_pacer.get_waited_ns());
+  }
+  // the cost model sees the write-back work, not the pacing
+  switch_model.observe_flush(sw.dirty_slots, flush_ns);
+  sw.puts.clear();
+  sw.dels.clear();
 
-    compiler_barrier();
+  Timer cost_timer;
+  cost_timer.begin();
+  g_cur_meta->relocate_value(sw.old_meta); // finish lazy initialization
+  switch_model.observe_relocate(sw.kept_keys, cost_timer.end());
 
-    auto del_meta = g_pre_meta;
+  compiler_barrier();
 
-    undo_log->logging_type2(g_gc_meta, g_pre_meta);
-    epoch_seq_lock.fetch_add(1);
-    g_gc_meta = g_pre_meta;
-    g_pre_meta = nullptr;
-    epoch_seq_lock.fetch_add(1);
+  undo_log->logging_type2(g_gc_meta ? g_gc_meta->record_oid() : OID_NULL,
+                          g_pre_meta->record_oid());
+  persist_views(g_cur_meta, nullptr, g_pre_meta);
+  undo_log->truncate();
 
-    persist_meta_ptrs();
-    undo_log->truncate();
+  epoch_seq_lock.fetch_add(1);
+  g_gc_meta = g_pre_meta;
+  g_pre_meta = nullptr;
+  epoch_seq_lock.fetch_add(1);
 
-    // timer.end_print(1);
+  // operations in progress now may still use the old view
+  for (int i = 0; i < kMaxThreadCnt; ++i) {
+    sw.grace_seq[i] = thread_meta_array[i].op_seq;
+  }
+  sw.phase = SWITCH_GRACE;
+}
 
-    // printf("-----------%ld-----------\n", g_cur_epoch.load());
+// socket of the raw index data of a key, -1 if unknown
+template <class T> int Nap<T>::home_numa_of(const Node &n) {
+  if constexpr (HasNumaOf<T>::value) {
+    return raw_index->numa_of(Slice(n.key));
+  } else {
+    return -1;
+  }
+}
 
-    // wait a grace period period for safe dealloction.
+// order candidates by expected remote-access savings: frequency times the
+// sampled share of accesses from sockets other than the key's home. A key
+// accessed only from its home gains nothing from the NAL and is left in the
+// raw index.
+template <class T> void Nap<T>::rank_by_remote_savings(std::vector<Node> &l) {
+  std::vector<std::pair<double, Node>> ranked;
+  for (size_t i = 1; i < l.size(); ++i) {
+    double savings = expected_savings(l[i]);
+    if (savings > 0) {
+      ranked.emplace_back(savings, std::move(l[i]));
+    }
+  }
+
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const std::pair<double, Node> &a,
+                      const std::pair<double, Node> &b) {
+                     return a.first > b.first;
+                   });
+  l.erase(l.begin() + 1, l.end());
+  for (auto &r : ranked) {
+    l.push_back(std::move(r.second));
+  }
+}
+
+// p99 of the foreground latencies sampled since the previous call, called
+// by the shift thread only
+template <class T> uint64_t Nap<T>::foreground_p99() {
+  uint64_t delta[LatencyHistogram::kBuckets];
+  for (int b = 0; b < LatencyHistogram::kBuckets; ++b) {
+    uint64_t all = 0;
     for (int i = 0; i < kMaxThreadCnt; ++i) {
-      auto &m = thread_meta_array[i];
-      auto cur_seq = m.op_seq;
+      all += thread_meta_array[i].latency.cnt[b];
+    }
+    delta[b] = all - latency_seen[b];
+    latency_seen[b] = all;
+  }
+  return LatencyHistogram::quantile(delta, 0.99);
+}
 
-    retry:
-      if (!m.is_in_nap) {
-        continue;
-      }
-      if (m.op_seq != cur_seq) {
+// keys not sampled in the window by its second half, on the home socket
+// and in the aggregators alike, are cold, their newest values are written
+// back ahead of the switch. Samples of earlier windows, which a decaying
+// detector still counts, do not keep a key hot.
+template <class T> void Nap<T>::trickle_in_idle() {
+  if (!trickle || nal_mode != NAL_IN_PLACE ||
+      Timer::get_time_ns() < trickle_from_ns) {
+    return;
+  }
+
+  auto cur_meta = g_cur_meta;
+  if (trickle_meta != cur_meta) {
+    trickle_meta = cur_meta;
+    trickle_cursor = 0;
+  }
+  if (trickle_cursor >= cur_meta->sp_view->get_size()) {
+    return; // done for this window
+  }
+
+  trickle_written += cur_meta->write_back_cold(
+      raw_index, trickle_cursor, kTrickleBatch,
+      [this](const Slice &key) {
+        return !CM->sampled_in_window(key) &&
+               !aggregator.sampled_in_window(key);
+      });
+}
+
+// pre-build the NapMeta of a hot set the history expects back within a few
+// windows. It is rebuilt if the current hot set changed in between (which
+// keys are kept from the current epoch), and dropped if the hot set did not
+// come back in time.
+template <class T>
+void Nap<T>::prebuild_predicted(const std::vector<NapPair> &cur_list,
+                                double window) {
+  auto now = Timer::get_time_ns();
+  uint64_t lead_ns = kPrebuildLeadWindows * window * (1000ull * 1000 * 1000);
+
+  if (prebuilt && (!predictive || now > prebuilt_expire_ns)) {
+    delete prebuilt;
+    prebuilt = nullptr;
+    prebuilt_set = HotSetHistory::HotSet();
+  }
+  if (!predictive) {
+    return;
+  }
+
+  if (prebuilt == nullptr) {
+    auto *p = history.predict(now, lead_ns);
+    if (p == nullptr) {
+      return;
+    }
+    prebuilt_set = p->hot_set;
+    prebuilt_expire_ns = p->predicted_ns + lead_ns;
+  } else if (prebuilt_epoch == g_cur_epoch) {
+    return;
+  } else {
+    delete prebuilt;
+    prebuilt = nullptr;
+  }
+
+  auto &list = prebuilt_set.list;
+  prebuilt_kept = 0;
+  for (size_t i = 0, j = 0; j < list.size(); ++j) {
+    while (i < cur_list.size() && cur_list[i].first < list[j].first) {
+      i++;
+    }
+    if (i < cur_list.size() && cur_list[i].first == list[j].first) {
+      list[j].second = WhereIsData::IN_PREVIOUS_EPOCH;
+      prebuilt_kept++;
+    } else {
+      list[j].second = WhereIsData::IN_RAW_INDEX;
+    }
+  }
+
+  prebuilt = new NapMeta(pm, list, nal_mode, slot_layout,
+                         &prebuilt_set.write_freq, &prebuilt_set.dram_only,
+                         prebuilt_set.spare_slots);
+  prebuilt_epoch = g_cur_epoch;
+}
+
+// most of a sample of the current candidates belong to the pre-built hot
+// set, more than to the current one.
+template <class T>
+bool Nap<T>::predicted_burst(const std::vector<NapPair> &cur_list) {
+  auto contains = [](const std::vector<NapPair> &list, const std::string &k) {
+    auto it = std::lower_bound(
+        list.begin(), list.end(), k,
+        [](const NapPair &p, const std::string &k) { return p.first < k; });
+    return it != list.end() && it->first == k;
+  };
+
+  auto &l = CM->get_list();
+  size_t n = std::min(l.size(), kPredictSample + 1);
+  if (n <= kPredictSample / 4) {
+    return false;
+  }
+
+  size_t in_pre = 0, in_cur = 0;
+  for (size_t i = 1; i < n; ++i) {
+    in_pre += contains(prebuilt_set.list, l[i].key);
+    in_cur += contains(cur_list, l[i].key);
+  }
+  return in_pre >= kPredictMatch * (n - 1) && in_pre > in_cur;
+}
+
+// the hit ratio of the current hot set since the last evaluation is below
+// the floor, once the window has run for its minimum length. ``ops`` and
+// ``hits`` keep the totals of the last evaluation.
+template <class T>
+bool Nap<T>::hit_ratio_dropped(uint64_t &ops, uint64_t &hits,
+                               uint64_t begin_ns) {
+  uint64_t all_op = 0, all_hit = 0;
+  for (int i = 0; i < kMaxThreadCnt; ++i) {
+    all_op += thread_meta_array[i].op_seq;
+    all_hit += thread_meta_array[i].hit_in_cap;
+  }
+
+  if (all_op < ops || all_hit < hits) { // clear() in between
+    ops = hits = 0;
+  }
+  if (begin_ns && all_op - ops < IntervalTuner::kMinOps) {
+    return false;
+  }
+
+  bool res = false;
+  if (begin_ns &&
+      Timer::get_time_ns() - begin_ns >
+          interval_tuner.get_min_window() * (1000ull * 1000 * 1000)) {
+    res = interval_tuner.hit_ratio_low(all_op - ops, all_hit - hits);
+  }
+
+  ops = all_op;
+  hits = all_hit;
+  return res;
+}
+
+// sampled remote accesses of a hot key which the NAL saves. Unless the raw
+// index tells where the key lives, its data is on any socket with equal
+// probability.
+template <class T> double Nap<T>::expected_savings(const Node &n) {
+  int home = home_numa_of(n);
+  if (home >= 0) {
+    return n.cnt * n.remote_share(home, Topology::kNumaCnt);
+  }
+  return n.cnt * (Topology::kNumaCnt - 1.0) / Topology::kNumaCnt;
+}
+
+template <class T> bool Nap<T>::is_read_mostly(const Node &n) {
+  int total = 0;
+  for (int i = 0; i < Topology::kNumaCnt; ++i) {
+    total += n.numa_cnt[i];
+  }
+  return n.w_cnt * 100 <= total * kReadMostlyWritePct;
+}
+
+// keep the candidates of ``l`` (in priority order) which fit: at most hot_cnt
+// of them need a PC-view slot, DRAM-only ones do not count. Returns the
+// number of slots used.
+template <class T> size_t Nap<T>::select_hot_set(std::vector<Node> &l) {
+  bool slotless = read_only_entries && nal_mode == NAL_IN_PLACE;
+  size_t slots = 0;
+  size_t j = 1;
+  for (size_t i = 1; i < l.size(); ++i) {
+    if (!slotless || !is_read_mostly(l[i])) {
+      if (slots == (size_t)hot_cnt) {
         continue;
       }
+      slots++;
+    }
+    if (i != j) {
+      l[j] = std::move(l[i]);
+    }
+    j++;
+  }
+  l.erase(l.begin() + j, l.end());
+  return slots;
+}
 
-      mfence();
-      goto retry;
+// first write of a DRAM-only entry (its lock held): take a spare slot, or
+// write through to the raw index. The latter has to wait until the previous
+// epoch is written back, which could overwrite the key with an older value.
+// Returns false if the lock was released and the request must be retried.
+template <class T>
+bool Nap<T>::wait_for_slot(CNView::Entry *e, NapMeta *cur_meta,
+                           NapMeta *pre_meta) {
+  if (cur_meta->promote(e) || pre_meta == nullptr) {
+    return true;
+  }
+
+  e->l.putUnlock();
+  wait_switch_end(thread_meta_array[Topology::threadID()]);
+  return false;
+}
+
+// the key is in the previous view, which the switch still writes back
+template <class T> void Nap<T>::wait_switch_end(ThreadMeta &m) {
+  m.is_in_nap = false;
+  m.waited_switch = true;
+  while (g_pre_meta != nullptr) {
+    mfence();
+  }
+  m.is_in_nap = true;
+}
+
+#ifndef FIX_8_BYTE_VALUE
+template <class T> void Nap<T>::compact_in_idle() {
+
+  switch (compact_phase) {
+  case COMPACT_SELECT: {
+    auto now = Timer::get_time_ns();
+    if (now - compact_ts < kCompactPeriodNs) {
+      return;
     }
+    compact_ts = now;
 
-    delete del_meta;
-    g_gc_meta = nullptr;
-    persist_meta_ptrs();
+    if (pm.cow_alloc->select_sparse_pages(kCompactSparseRatio) == 0) {
+      return;
+    }
+    compact_meta = g_cur_meta;
+    compact_cursor = 0;
+    compact_phase = COMPACT_RELOCATE;
+  }
 
-#ifdef USE_GLOBAL_LOCK
-    shift_global_lock.write_unlock();
-#endif
-    // printf("delete meta of epoch %ld safely\n", g_cur_epoch - 1);
+  break;
+  case COMPACT_RELOCATE: {
+    // a switch happened, the values now live in the new PC-view
+    if (compact_meta != g_cur_meta) {
+      compact_meta = g_cur_meta;
+      compact_cursor = 0;
+    }
+
+    compact_relocated += compact_meta->compact(compact_cursor, kCompactBatch);
+    if (compact_meta->sp_view == nullptr ||
+        compact_cursor >= compact_meta->sp_view->get_size()) {
+      compact_phase = COMPACT_RELEASE;
+    }
   }
 
-  printf("shift thread stopped.\n");
+  break;
+  case COMPACT_RELEASE: {
+    compact_released += pm.cow_alloc->release_empty_pages();
+    compact_phase = COMPACT_SELECT;
+  }
+
+  break;
+  default:
+    break;
+  }
 }
+#endif
 
 } // namespace nap
 
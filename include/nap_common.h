@@ -4,7 +4,10 @@
 #include "slice.h"
 #include <string>
 
+// define VAR_LENGTH_VALUE to store values out-of-place with the CoW alloctor
+#ifndef VAR_LENGTH_VALUE
 #define FIX_8_BYTE_VALUE
+#endif
 // #define SUPPORT_RANGE
 
 namespace nap {
@@ -17,14 +20,55 @@ enum WhereIsData : char {
 
 using NapPair = std::pair<std::string, WhereIsData>;
 
+// placement of hot keys' slots in the PC-view
+enum SlotLayout : char {
+  SLOT_SHUFFLED,       // random placement
+  SLOT_XPLINE_HOTNESS, // write-hot slots share XPLines, read-mostly ones after
+};
+
+// how the NUMA-aware log (NAL) of the PC-view persists updates
+enum NalMode : char {
+  NAL_IN_PLACE, // one value slot per key per NUMA node (SPView)
+  NAL_LOG,      // per-NUMA, per-thread append-only log segments (LogView)
+};
+
+// how the shift thread finds hot keys
+enum DetectorKind : char {
+  DETECTOR_COUNT_MIN,         // count-min sketch plus a top-K heap (CountMin)
+  DETECTOR_SPACE_SAVING,      // counters of the top-K keys only (SpaceSaving)
+  DETECTOR_BLOCKED_COUNT_MIN, // one cache line per key (BlockedCountMin)
+};
+
+#if defined(SPACE_SAVING_DETECTOR)
+constexpr DetectorKind kDefaultDetector = DETECTOR_SPACE_SAVING;
+#elif defined(BLOCKED_SKETCH_DETECTOR)
+constexpr DetectorKind kDefaultDetector = DETECTOR_BLOCKED_COUNT_MIN;
+#else
+constexpr DetectorKind kDefaultDetector = DETECTOR_COUNT_MIN;
+#endif
+
+// who runs hot-key detection and switches
+enum ShiftMode : char {
+  SHIFT_DEDICATED, // a busy-polling shift thread per Nap instance
+  SHIFT_SHARED,    // one thread for all instances, sleeping while idle
+};
+
+#ifdef SHARED_SHIFT_THREAD
+constexpr ShiftMode kDefaultShiftMode = SHIFT_SHARED;
+#else
+constexpr ShiftMode kDefaultShiftMode = SHIFT_DEDICATED;
+#endif
+
 constexpr int kCachelineSize = 64;
+constexpr int kXPLineSize = 256; // internal write granularity of Optane
 constexpr int kMaxNumaCnt = 8;
 constexpr int kMaxThreadCnt = 80;
 
 constexpr int kHotKeys = 100000;
 
-class CowAlloctor;
-extern CowAlloctor *cow_alloc;
+// PMDK pools of a Nap instance, one per NUMA node (%d)
+constexpr const char *kDefaultPoolPath = "/mnt/pmem%d/nap";
+constexpr size_t kDefaultPoolSize = 16ull * 1024 * 1024 * 1024;
 
 
 inline void mfence() { asm volatile("mfence\n" : : : "memory"); }
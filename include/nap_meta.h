@@ -2,26 +2,84 @@
 #define _NAP_META_H_
 
 #include "cn_view.h"
+#include "nal_log.h"
 #include "sp_view.h"
 
+#include <algorithm>
+#include <cassert>
+
 namespace nap
 {
 
+// PM of one Nap instance: a pool per NUMA node, and the allocators which
+// carve the NAL out of them
+struct NapPmem {
+	pmem::obj::pool_base pools[kMaxNumaCnt];
+	SPViewPool sp_views{pools};
+	LogSegmentPool log_segments{pools};
+	CowAlloctor *cow_alloc{nullptr};
+};
+
 struct NapMeta {
 	CNView *cn_view;
 	SPView *sp_view;
+	LogView *log_view;
+	NalMode nal_mode;
 	// TODO bloom filter
 
-	NapMeta(): cn_view(nullptr), sp_view(nullptr)
+	NapMeta()
+	    : cn_view(nullptr), sp_view(nullptr), log_view(nullptr),
+	      nal_mode(NAL_IN_PLACE)
 	{
 	}
 
-	NapMeta(std::vector<NapPair> &_list)
+	// ``write_freq`` and ``dram_only`` are aligned with ``_list``.
+	// ``write_freq`` is only used by SLOT_XPLINE_HOTNESS. Keys marked in
+	// ``dram_only`` get no PC-view slot, but may take one of
+	// ``spare_slots`` on their first write (in-place NAL only). The views
+	// are allocated from ``pm``.
+	NapMeta(NapPmem &pm, std::vector<NapPair> &_list,
+	        NalMode nal_mode = NAL_IN_PLACE,
+	        SlotLayout layout = SLOT_SHUFFLED,
+	        const std::vector<uint32_t> *write_freq = nullptr,
+	        const std::vector<bool> *dram_only = nullptr,
+	        size_t spare_slots = 0)
+	    : sp_view(nullptr), log_view(nullptr), nal_mode(nal_mode)
 	{
-        auto list = _list;
-		std::random_shuffle(list.begin(), list.end());
-		cn_view = new CNView(list);
-		sp_view = new SPView(list);
+		std::vector<size_t> order;
+		if (layout == SLOT_XPLINE_HOTNESS && write_freq) {
+			order = layout_by_hotness(*write_freq);
+		} else {
+			order.resize(_list.size());
+			for (size_t i = 0; i < order.size(); ++i) {
+				order[i] = i;
+			}
+			std::random_shuffle(order.begin(), order.end());
+		}
+
+		size_t slot_cnt = order.size();
+		if (nal_mode == NAL_IN_PLACE && dram_only) {
+			assert(dram_only->size() == _list.size());
+			auto it = std::stable_partition(
+			    order.begin(), order.end(),
+			    [&](size_t i) { return !(*dram_only)[i]; });
+			slot_cnt = it - order.begin();
+		}
+
+		std::vector<NapPair> list;
+		list.reserve(order.size());
+		for (auto i : order) {
+			list.push_back(_list[i]);
+		}
+
+		cn_view = new CNView(list, slot_cnt);
+		if (nal_mode == NAL_LOG) {
+			log_view = new LogView(list, &pm.log_segments);
+		} else {
+			sp_view = new SPView(list, slot_cnt,
+			                     dram_only ? spare_slots : 0,
+			                     &pm.sp_views, pm.cow_alloc);
+		}
 	}
 
 	~NapMeta() {
@@ -31,13 +89,149 @@ struct NapMeta {
 		if (sp_view) {
 			delete sp_view;
 		}
+		if (log_view) {
+			delete log_view;
+		}
+	}
+
+	char *
+	alloc_before_update(const Slice &key, const Slice &value)
+	{
+		if (nal_mode == NAL_LOG) {
+			return nullptr;
+		}
+		return sp_view->alloc_before_update(key, value);
+	}
+
+	// persist an update into the NAL, the caller holds the entry lock
+	void
+	update(CNView::Entry *e, char *ptr, const Slice &key,
+	       const Slice &value, uint64_t new_version, bool is_del = false)
+	{
+		if (nal_mode == NAL_LOG) {
+			e->nal_ptr = log_view->append(e->sp_view_index, key, value,
+			                              new_version, is_del);
+		} else {
+			sp_view->update(e->sp_view_index, ptr, key, value,
+			                new_version, is_del);
+		}
+	}
+
+	// give a DRAM-only entry a spare PC-view slot, false if none is left.
+	// the caller holds the entry lock.
+	bool
+	promote(CNView::Entry *e)
+	{
+		if (e->sp_view_index != -1) {
+			return true;
+		}
+		int slot = sp_view->promote(e->key_index);
+		if (slot == -1) {
+			return false;
+		}
+		e->sp_view_index = slot;
+		return true;
+	}
+
+	// PM address written by the last update of ``e``
+	void *
+	last_write_addr(CNView::Entry *e)
+	{
+		if (nal_mode == NAL_LOG) {
+			return e->nal_ptr;
+		}
+		return sp_view->slot_addr(e->sp_view_index);
+	}
+
+	// PM bytes an update of a ``value_size`` value writes
+	size_t
+	write_bytes(size_t value_size)
+	{
+		if (nal_mode == NAL_LOG) {
+			return LogRecord::length(value_size);
+		}
+		return SPView::write_bytes(value_size);
+	}
+
+	// order slots by sampled write frequency, so that the hottest write
+	// keys share XPLines (absorbed by the DIMM's write-combining buffer)
+	// and read-mostly keys are packed after them.
+	static std::vector<size_t>
+	layout_by_hotness(const std::vector<uint32_t> &write_freq)
+	{
+		std::vector<size_t> order(write_freq.size());
+		for (size_t i = 0; i < order.size(); ++i) {
+			order[i] = i;
+		}
+		// ties (e.g., read-only keys) are still spread randomly
+		std::random_shuffle(order.begin(), order.end());
+		std::stable_sort(order.begin(), order.end(),
+		                 [&](size_t a, size_t b) {
+			                 return write_freq[a] > write_freq[b];
+		                 });
+		return order;
 	}
 
 	template <class T>
 	void
-	flush_sp_view(T *raw_index)
+	flush_sp_view(T *raw_index, FlushPacer *pacer = nullptr)
 	{
-		sp_view->flush_to_raw_index<T>(raw_index);
+		if (nal_mode == NAL_LOG) {
+			log_view->flush_to_raw_index<T>(raw_index, cn_view, pacer);
+		} else {
+			sp_view->flush_to_raw_index<T>(raw_index, pacer);
+		}
+	}
+
+	// the puts and deletes of flush_sp_view, for a write-back in slices
+	template <class T>
+	void
+	collect_write_back(T *raw_index, KVBatch &batch,
+	                   std::vector<Slice> &tombstones)
+	{
+		if (nal_mode == NAL_LOG) {
+			log_view->collect_dirty(cn_view, batch, tombstones);
+		} else {
+			sp_view->collect_dirty<T>(raw_index, batch, tombstones);
+		}
+	}
+
+	// where the NAL view is recorded in PM, OID_NULL if it is empty
+	PMEMoid
+	record_oid()
+	{
+		return nal_mode == NAL_LOG ? log_view->record_oid()
+		                           : sp_view->record_oid();
+	}
+
+	// write back the view recorded at ``oid`` by a previous run of the
+	// pools, see SPView::recover. Returns the number of keys visited.
+	template <class T, class F>
+	static size_t
+	recover(PMEMoid oid, T *raw_index, F &&translate)
+	{
+		if (OID_IS_NULL(oid)) {
+			return 0;
+		}
+		auto *rec = (ViewRecord *)pmemobj_direct(oid);
+		if (rec->nal_mode == NAL_LOG) {
+			return LogView::recover(rec, raw_index);
+		}
+		return SPView::recover(rec, raw_index, translate);
+	}
+
+	// keys a write-back would visit
+	size_t
+	dirty_count()
+	{
+		if (nal_mode == NAL_LOG) {
+			size_t cnt = 0;
+			for (auto &e : cn_view->view) {
+				cnt += e.second.nal_ptr != nullptr;
+			}
+			return cnt;
+		}
+		return sp_view->dirty_count();
 	}
 
 	void
@@ -45,6 +239,66 @@ struct NapMeta {
 	{
         cn_view->relocate_value(old_meta->cn_view);
 	}
+
+	// write back the dirty slots of [cursor, cursor + budget) whose keys
+	// are cold, the slots stay valid but the switch skips them. Returns the
+	// number of slots written back.
+	template <class T, class F>
+	size_t
+	write_back_cold(T *raw_index, size_t &cursor, size_t budget, F &&is_cold)
+	{
+		size_t written = 0;
+		if (sp_view == nullptr) {
+			cursor = 0;
+			return 0;
+		}
+		std::vector<Slice> tombstones;
+		size_t end = std::min(cursor + budget, sp_view->get_size());
+		for (; cursor < end; ++cursor) {
+			if (!sp_view->is_dirty(cursor)) {
+				continue;
+			}
+			CNView::Entry *e;
+			auto key = sp_view->slot_key(cursor);
+			if (key.size() == 0 || !is_cold(key) ||
+			    !cn_view->get_entry(key, e)) {
+				continue;
+			}
+			// readers go on, writers of the key wait
+			e->l.rLock();
+			sp_view->flush_slot(raw_index, cursor, tombstones);
+			flush_deletes(raw_index, tombstones);
+			e->l.rUnlock();
+			written++;
+		}
+		return written;
+	}
+
+#ifndef FIX_8_BYTE_VALUE
+	// move live CoW values of slots [cursor, cursor + budget) out of
+	// evacuating slab pages, return the number of moved values.
+	size_t
+	compact(size_t &cursor, size_t budget)
+	{
+		size_t relocated = 0;
+		if (sp_view == nullptr) {
+			cursor = 0;
+			return 0;
+		}
+		size_t end = std::min(cursor + budget, sp_view->get_size());
+		for (; cursor < end; ++cursor) {
+			CNView::Entry *e;
+			auto key = sp_view->slot_key(cursor);
+			if (key.size() == 0 || !cn_view->get_entry(key, e)) {
+				continue;
+			}
+			e->l.wLock();
+			relocated += sp_view->relocate(cursor);
+			e->l.wUnlock();
+		}
+		return relocated;
+	}
+#endif
 };
 } // namespace nap
 
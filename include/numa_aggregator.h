@@ -0,0 +1,135 @@
+#if !defined(_NUMA_AGGREGATOR_H_)
+#define _NUMA_AGGREGATOR_H_
+
+#include "hot_set_detector.h"
+#include "nap_common.h"
+#include "slice.h"
+#include "topology.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace nap {
+
+// One aggregator thread per remote socket drains the record rings of that
+// socket's threads into a detector of its own, so that no ring is read
+// across sockets and the shift thread polls its local threads only. At the
+// end of a window the shift thread merges the per-socket detectors into
+// its own; the aggregators pause from then until the next reset, like the
+// shift thread stops polling while it switches.
+class NumaAggregator {
+public:
+  ~NumaAggregator() { stop(); }
+
+  // ``make`` creates an empty detector of the kind of ``src``, without rings
+  void start(HotSetDetector *src,
+             const std::function<HotSetDetector *()> &make) {
+    this->src = src;
+    home = Topology::numaID();
+    running = true;
+    paused = true; // until the first reset
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      if (k != home) {
+        nodes[k].detector = make();
+        nodes[k].thread = std::thread(&NumaAggregator::run, this, k);
+      }
+    }
+  }
+
+  void stop() {
+    if (!running) {
+      return;
+    }
+    running = false;
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      if (k != home) {
+        nodes[k].thread.join();
+        delete nodes[k].detector;
+        nodes[k].detector = nullptr;
+      }
+    }
+  }
+
+  bool is_running() const { return running; }
+
+  // socket of the shift thread, whose rings it still polls itself
+  int home_numa() const { return home; }
+
+  void set_candidates(int k) {
+    for_each_node([k](HotSetDetector *d) { d->set_candidates(k); });
+  }
+
+  // start a window
+  void reset() {
+    for_each_node([](HotSetDetector *d) { d->reset(); });
+    paused = false;
+  }
+
+  // whether ``key`` was drained since the last reset, on any socket
+  bool sampled_in_window(const Slice &key) {
+    bool sampled = false;
+    for_each_node([&](HotSetDetector *d) {
+      sampled = sampled || d->sampled_in_window(key);
+    });
+    return sampled;
+  }
+
+  // end a window, merge every socket into ``src``
+  void merge() {
+    paused = true;
+    for_each_node([this](HotSetDetector *d) { src->merge(*d); });
+  }
+
+private:
+  constexpr static uint64_t kIdleSleepUs = 50;
+
+  struct Node {
+    HotSetDetector *detector{nullptr};
+    std::thread thread;
+    std::mutex lock; // held by the aggregator while it drains a round
+  };
+
+  void for_each_node(const std::function<void(HotSetDetector *)> &f) {
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      if (k != home && nodes[k].detector) {
+        std::lock_guard<std::mutex> guard(nodes[k].lock);
+        f(nodes[k].detector);
+      }
+    }
+  }
+
+  void run(int numa) {
+    // any core of the socket: the aggregators of every instance would
+    // share one core, and it would be a worker's
+    bindNuma(numa);
+
+    auto &node = nodes[numa];
+    while (running) {
+      size_t n = 0;
+      if (!paused) {
+        std::lock_guard<std::mutex> guard(node.lock);
+        for (int i = 0; i < kMaxThreadCnt; ++i) {
+          if (Topology::numaOf(i) == numa) {
+            n += src->drain(i, node.detector);
+          }
+        }
+      }
+      if (n == 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(kIdleSleepUs));
+      }
+    }
+  }
+
+  HotSetDetector *src{nullptr};
+  int home{0};
+  std::atomic<bool> running{false};
+  std::atomic<bool> paused{true};
+  Node nodes[kMaxNumaCnt];
+};
+
+} // namespace nap
+
+#endif // _NUMA_AGGREGATOR_H_
@@ -88,6 +88,39 @@ inline void clflushopt_range(void *des, size_t size) {
   persistent_barrier();
 }
 
+inline void nt_store64(void *dst, uint64_t v) {
+  _mm_stream_si64((long long *)dst, (long long)v);
+}
+
+// non-temporal copy without the trailing sfence. The unaligned head and the
+// tail (each within one 8-byte word) go through the cache and are written
+// back.
+inline void nt_memcpy(void *dst, const void *src, size_t size) {
+  char *d = (char *)dst;
+  const char *s = (const char *)src;
+
+  size_t head = (8 - ((uint64_t)d & 7)) & 7;
+  if (head > size) {
+    head = size;
+  }
+  if (head) {
+    memcpy(d, s, head);
+    clwb(d);
+    d += head, s += head, size -= head;
+  }
+
+  for (; size >= 8; size -= 8, d += 8, s += 8) {
+    uint64_t v;
+    memcpy(&v, s, sizeof(v));
+    nt_store64(d, v);
+  }
+
+  if (size) {
+    memcpy(d, s, size);
+    clwb(d);
+  }
+}
+
 inline void nt_copy(void *dst, void *src, int size) {
   __asm__ __volatile__("cmpl $8,%%edx;"
                        "jb L_4b_nocache_copy_entry;"
@@ -0,0 +1,106 @@
+#if !defined(_SHIFT_SCHEDULER_H_)
+#define _SHIFT_SCHEDULER_H_
+
+#include "topology.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nap {
+
+// the detection and switch work of one Nap instance, in slices
+class ShiftTask {
+public:
+  virtual ~ShiftTask() {}
+
+  // do one bounded slice of work, return false if there was nothing to do
+  virtual bool shift_step() = 0;
+};
+
+// One background thread which runs the shift work of every Nap instance
+// in SHIFT_SHARED mode, round-robin, and sleeps while none of them has
+// anything to do, instead of a busy shift thread per instance. The thread
+// is started with the first task and stopped with the last one.
+class ShiftScheduler {
+public:
+  void add(ShiftTask *t) {
+    std::lock_guard<std::mutex> start_stop(life);
+    std::lock_guard<std::mutex> guard(lock);
+    tasks.push_back(t);
+    if (!running) {
+      running = true;
+      thread = std::thread(&ShiftScheduler::run, this);
+    }
+  }
+
+  // returns once ``t`` is not run any more
+  void remove(ShiftTask *t) {
+    std::lock_guard<std::mutex> start_stop(life);
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      tasks.erase(std::remove(tasks.begin(), tasks.end(), t), tasks.end());
+      stepped.wait(guard, [&] { return current != t; });
+      if (!tasks.empty() || !running) {
+        return;
+      }
+      running = false;
+    }
+    thread.join();
+  }
+
+private:
+  constexpr static uint64_t kIdleSleepUs = 100;
+
+  // the steps run without ``lock``, on a copy of the tasks, so that adding
+  // and removing a task waits for one step at most
+  void run() {
+    bindCore(Topology::threadID());
+
+    std::vector<ShiftTask *> round;
+    while (running) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        round = tasks;
+      }
+
+      bool busy = false;
+      for (auto *t : round) {
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          if (std::find(tasks.begin(), tasks.end(), t) == tasks.end()) {
+            continue; // removed meanwhile
+          }
+          current = t;
+        }
+        busy |= t->shift_step();
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          current = nullptr;
+        }
+        stepped.notify_all();
+      }
+      if (!busy) {
+        std::this_thread::sleep_for(std::chrono::microseconds(kIdleSleepUs));
+      }
+    }
+  }
+
+  std::mutex life; // serializes starting and stopping the thread
+  std::mutex lock; // guards ``tasks`` and ``current``
+  std::condition_variable stepped;
+  std::vector<ShiftTask *> tasks;
+  ShiftTask *current{nullptr}; // whose step the thread runs
+  std::thread thread;
+  std::atomic<bool> running{false};
+};
+
+extern ShiftScheduler shift_scheduler;
+
+} // namespace nap
+
+#endif // _SHIFT_SCHEDULER_H_
@@ -1,38 +1,276 @@
 #if !defined(_SP_VIEW_H_)
 #define _SP_VIEW_H_
 
+#include "flush_pacer.h"
 #include "murmur_hash2.h"
 #include "nap_common.h"
 #include "nvm.h"
+#include "rw_lock.h"
 #include "slice.h"
 #include "topology.h"
+#include "version_clock.h"
 
 #include "cow_alloctor.h"
 
+#include <algorithm>
+#include <immintrin.h>
 #include <vector>
 
 namespace nap {
 
-struct alignas(kCachelineSize) AlignedCounter {
-  std::atomic<uint64_t> ver;
+// Retired PM arrays of the PC-view, per NUMA node. A switch takes an array
+// of a previous epoch instead of a PMDK transaction plus make_persistent
+// (which zeroes) and a pmemobj_free per switch.
+//
+// Slots keep the low 16 bits of their view's stamp. An array is recycled
+// only by views whose stamps share the high bits with the one it was
+// retired by; after the low bits wrap, arrays of the previous round are
+// freed instead, so that no stale slot carries the stamp of a new view.
+class SPViewPool {
+public:
+  // new arrays come from ``pools``, one per NUMA node
+  explicit SPViewPool(pmem::obj::pool_base *pools) : pools(pools) {}
+
+  // a buffer of at least ``bytes`` for the view stamped ``stamp``, its real
+  // capacity is returned
+  char *get(int numa_id, size_t bytes, size_t &capacity, uint32_t stamp) {
+    char *res = nullptr;
+    std::vector<char *> stale;
+
+    locks[numa_id].l.wLock();
+    auto &l = free_list[numa_id];
+    for (size_t i = 0; i < l.size();) {
+      if (l[i].round != stamp >> kStampBits) {
+        stale.push_back(l[i].base);
+        l[i] = l.back();
+        l.pop_back();
+      } else {
+        ++i;
+      }
+    }
+    int best = -1;
+    for (size_t i = 0; i < l.size(); ++i) {
+      if (l[i].capacity >= bytes &&
+          (best == -1 || l[i].capacity < l[best].capacity)) {
+        best = i;
+      }
+    }
+    if (best != -1) {
+      res = l[best].base;
+      capacity = l[best].capacity;
+      l.erase(l.begin() + best);
+    }
+    locks[numa_id].l.wUnlock();
+
+    for (auto *base : stale) {
+      PMEMoid oid = pmemobj_oid(base);
+      pmemobj_free(&oid);
+    }
+    if (res) {
+      return res;
+    }
+
+    // some slack, so that a slightly larger hot set still fits next time.
+    // zeroed once, so that slots freed by a previous run of the pool are
+    // never taken for ones of a view stamped the same
+    capacity = bytes + bytes / 8;
+    PMEMoid oid;
+    if (pmemobj_zalloc(pools[numa_id].handle(), &oid, capacity, 0)) {
+      fprintf(stderr, "fail to alloc nvm for PC-view\n");
+      exit(-1);
+    }
+    return (char *)pmemobj_direct(oid);
+  }
+
+  // retire a buffer of the view stamped ``stamp``
+  void put(int numa_id, char *base, size_t capacity, uint32_t stamp) {
+    char *victim = nullptr;
+
+    locks[numa_id].l.wLock();
+    auto &l = free_list[numa_id];
+    l.push_back({base, capacity, stamp >> kStampBits});
+    if (l.size() > kMaxRetired) {
+      auto it = std::min_element(l.begin(), l.end(),
+                                 [](const Buffer &a, const Buffer &b) {
+                                   return a.capacity < b.capacity;
+                                 });
+      victim = it->base;
+      l.erase(it);
+    }
+    locks[numa_id].l.wUnlock();
+
+    if (victim) {
+      PMEMoid oid = pmemobj_oid(victim);
+      pmemobj_free(&oid);
+    }
+  }
+
+  // distinguishes values written in the current incarnation of an array,
+  // its low kStampBits are never 0 so that a zeroed slot is not taken as
+  // valid
+  uint32_t next_stamp() {
+    uint32_t s;
+    do {
+      s = stamp.fetch_add(1) + 1;
+    } while ((uint16_t)s == 0);
+    return s;
+  }
+
+  constexpr static int kStampBits = 16; // kept in the slots
+
+private:
+  struct Buffer {
+    char *base;
+    size_t capacity;
+    uint32_t round; // stamp >> kStampBits of the view which retired it
+  };
+
+  struct alignas(kCachelineSize) PoolLock {
+    WRLock l;
+  };
+
+  // slot arrays and key buffers of the two live epochs, per node
+  constexpr static size_t kMaxRetired = 4;
+
+  pmem::obj::pool_base *pools;
+  PoolLock locks[kMaxNumaCnt];
+  std::vector<Buffer> free_list[kMaxNumaCnt];
+  std::atomic<uint32_t> stamp{0};
 };
 
-inline uint64_t get_version(const Slice &s) {
-  static AlignedCounter ver[128];
+// PM record of a NAL view, at the head of its key buffer: what a restart
+// needs to find the values the view holds. The root of a Nap instance
+// points at the records of its live views.
+struct alignas(kCachelineSize) ViewRecord {
+  uint32_t nal_mode;
+  uint32_t home_numa;
+  uint64_t key_cnt;
+  uint64_t spare_cnt; // in-place NAL
+  uint64_t slot_cnt;
+  uint64_t stamp;
+  PMEMoid slots[kMaxNumaCnt];   // in-place NAL: slot arrays, per node
+  PMEMoid heads[kMaxThreadCnt]; // log NAL: newest segment of every thread
+};
 
-  int p = MurmurHash64A(s.data(), s.size()) % 128;
+// the puts of a write-back, the values stay valid until it finishes
+typedef std::vector<std::pair<Slice, Slice>> KVBatch;
+
+// a raw index may take the puts of a write-back at once, and order them by
+// its own layout (segments, buckets, leaves)
+template <class I, class = void> struct HasBatchPut : std::false_type {};
+template <class I>
+struct HasBatchPut<I, std::void_t<decltype(std::declval<I &>().batch_put(
+                          std::declval<KVBatch &>()))>> : std::true_type {};
+
+// puts of a write-back, in batches of kPacedBatch while paced
+template <class T>
+void flush_puts(T *raw_index, KVBatch &kvs, FlushPacer *pacer = nullptr) {
+  constexpr size_t kPacedBatch = 1024;
+
+  if constexpr (HasBatchPut<T>::value) {
+    if (pacer == nullptr) {
+      raw_index->batch_put(kvs);
+    } else {
+      for (size_t b = 0; b < kvs.size(); b += kPacedBatch) {
+        KVBatch part(kvs.begin() + b,
+                     kvs.begin() + std::min(b + kPacedBatch, kvs.size()));
+        raw_index->batch_put(part);
+
+        size_t bytes = 0;
+        for (auto &kv : part) {
+          bytes += kv.first.size() + kv.second.size();
+        }
+        pacer->consume(bytes);
+      }
+    }
+  } else {
+    for (auto &kv : kvs) {
+      raw_index->put(kv.first, kv.second, true);
+      if (pacer) {
+        pacer->consume(kv.first.size() + kv.second.size());
+      }
+    }
+  }
+  kvs.clear();
+}
 
-  return ver[p].ver.fetch_add(1, std::memory_order::memory_order_relaxed);
+// deletes of a write-back, applied after all of its puts and in key order,
+// so that a tree index visits each leaf once.
+template <class T>
+void flush_deletes(T *raw_index, std::vector<Slice> &keys,
+                   FlushPacer *pacer = nullptr) {
+  std::sort(keys.begin(), keys.end(), [](const Slice &a, const Slice &b) {
+    return a.compare(b) < 0;
+  });
+  for (auto &k : keys) {
+    raw_index->del(k);
+    if (pacer) {
+      pacer->consume(k.size());
+    }
+  }
+  keys.clear();
+}
+
+// a write-back in slices of at most ``budget`` keys, puts first and then
+// deletes as in flush_deletes; ``cursor`` counts the keys written back so
+// far. Returns true once all of them are.
+template <class T>
+bool flush_slice(T *raw_index, KVBatch &kvs, std::vector<Slice> &keys,
+                 size_t &cursor, size_t budget, FlushPacer *pacer = nullptr) {
+  if (cursor < kvs.size()) {
+    KVBatch part(kvs.begin() + cursor,
+                 kvs.begin() + std::min(cursor + budget, kvs.size()));
+    cursor += part.size();
+    flush_puts(raw_index, part, pacer);
+    return cursor == kvs.size() && keys.empty();
+  }
+
+  size_t d = cursor - kvs.size();
+  if (d == 0) {
+    std::sort(keys.begin(), keys.end(), [](const Slice &a, const Slice &b) {
+      return a.compare(b) < 0;
+    });
+  }
+  for (size_t end = std::min(d + budget, keys.size()); d < end; ++d) {
+    raw_index->del(keys[d]);
+    if (pacer) {
+      pacer->consume(keys[d].size());
+    }
+  }
+  cursor = kvs.size() + d;
+  return d == keys.size();
 }
 
 class SPView {
   friend class NapMeta;
 
 public:
-  SPView() : size(0) { memset(&array, 0, sizeof(array)); }
+  SPView()
+      : pool(nullptr), cow(nullptr), record(nullptr), keys(nullptr),
+        owner(nullptr), key_bytes(nullptr), keys_cap(0), home_numa(0),
+        key_cnt(0),
+        fixed_cnt(0), spare_cnt(0), next_spare(0), size(0), stamp(0) {
+    memset(&slots, 0, sizeof(slots));
+    memset(&slots_base, 0, sizeof(slots_base));
+    alloc_dirty_bitmap();
+  }
 
-  SPView(const std::vector<std::pair<std::string, WhereIsData>> &list)
-      : size(list.size()) {
+  // keys of the whole ``list``; value slots for its first ``fixed_cnt`` keys,
+  // plus ``spare_cnt`` slots which ``promote`` hands out to the other
+  // (DRAM-only) keys on their first write. Arrays come from ``pool``, CoW
+  // values from ``cow``, both of the Nap instance.
+  SPView(const std::vector<std::pair<std::string, WhereIsData>> &list,
+         size_t fixed_cnt, size_t spare_cnt, SPViewPool *pool,
+         CowAlloctor *cow)
+      : pool(pool), cow(cow), record(nullptr), keys(nullptr),
+        owner(nullptr), key_bytes(nullptr), keys_cap(0),
+        home_numa(Topology::numaID()),
+        key_cnt(list.size()), fixed_cnt(fixed_cnt), spare_cnt(spare_cnt),
+        next_spare(0), size(fixed_cnt + spare_cnt),
+        stamp(pool->next_stamp()) {
+    memset(&slots, 0, sizeof(slots));
+    memset(&slots_base, 0, sizeof(slots_base));
+    alloc_dirty_bitmap();
     if (list.empty()) {
       return;
     }
@@ -42,69 +280,126 @@ public:
       key_total_length += list[i].first.size();
     }
 
-    pmem::obj::persistent_ptr<SPPair[]> array_p[Topology::kNumaCnt];
-    pmem::obj::persistent_ptr<char[]> keys_p[Topology::kNumaCnt];
-
-    for (int i = 0; i < Topology::kNumaCnt; ++i) {
-      pmem::obj::transaction::manual tx(*Topology::pmdk_pool_at(i));
-      array_p[i] = pmem::obj::make_persistent<SPPair[]>(list.size());
-      keys_p[i] = pmem::obj::make_persistent<char[]>(key_total_length);
-      pmem::obj::transaction::commit();
+    // keys are written once, on the node of the thread which builds the view
+    // (and later flushes it):
+    // | ViewRecord | SPKey * key_cnt | key index of each spare slot |
+    // | key bytes |
+    size_t meta_size = key_cnt * sizeof(SPKey) + spare_cnt * sizeof(uint32_t);
+    record = (ViewRecord *)pool->get(
+        home_numa, sizeof(ViewRecord) + meta_size + key_total_length,
+        keys_cap, stamp);
+    keys = (SPKey *)(record + 1);
+    owner = (uint32_t *)(keys + key_cnt);
+    key_bytes = (char *)keys + meta_size;
+    uint32_t off = 0;
+    for (size_t i = 0; i < list.size(); ++i) {
+      auto k_len = list[i].first.size();
+      persistent::nt_store64(&keys[i], (uint64_t)k_len << 32 | off);
+      persistent::nt_memcpy(key_bytes + off, list[i].first.c_str(), k_len);
+      off += k_len;
+    }
+    if (spare_cnt) {
+      memset(owner, 0xff, spare_cnt * sizeof(uint32_t));
+      persistent::clwb_range(owner, spare_cnt * sizeof(uint32_t));
     }
 
+    // every node only has value slots. recycled in-place slots are not
+    // touched: an incarnation counts only if it carries the stamp of this
+    // view.
     for (int k = 0; k < Topology::kNumaCnt; ++k) {
-      array[k] = array_p[k].get();
-      auto keys_start = keys_p[k].get();
-      for (size_t i = 0; i < list.size(); ++i) {
-        auto k_len = list[i].first.size();
-        array_p[k][i].k_size = k_len;
-        array_p[k][i].k = keys_start;
-#ifdef FIX_8_BYTE_VALUE
-        array_p[k][i].type = 2;
-#else
-        array_p[k][i].v.v_ptr = nullptr;
+      // spare slots to start the array at an XPLine boundary
+      slots_base[k] = (SPSlot *)pool->get(
+          k, (size + kSlotPerXPLine - 1) * sizeof(SPSlot), slots_cap[k],
+          stamp);
+
+      slots[k] = (SPSlot *)(((uint64_t)slots_base[k] + kXPLineSize - 1) &
+                            (~(kXPLineSize - 1ull)));
+
+#ifndef FIX_8_BYTE_VALUE
+      for (size_t i = 0; i < size; ++i) {
+        persistent::nt_store64(&slots[k][i].v.v_ptr, 0);
+      }
 #endif
-        memcpy(keys_start, list[i].first.c_str(), k_len);
-        keys_start += k_len;
+    }
+
+    memset(record, 0, sizeof(ViewRecord));
+    record->nal_mode = NAL_IN_PLACE;
+    record->home_numa = home_numa;
+    record->key_cnt = key_cnt;
+    record->spare_cnt = spare_cnt;
+    record->slot_cnt = size;
+    record->stamp = stamp;
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      record->slots[k] = pmemobj_oid(slots_base[k]);
+    }
+    persistent::clwb_range(record, sizeof(ViewRecord));
+  }
+
+  // write the values of the view recorded at ``rec`` by a previous run of
+  // the pools back into the raw index, all slots are taken as dirty.
+  // ``translate`` maps a CoW value address of that run to this one. Returns
+  // the number of slots visited.
+  template <class T, class F>
+  static size_t recover(ViewRecord *rec, T *raw_index, F &&translate) {
+    SPView v(rec);
+#ifndef FIX_8_BYTE_VALUE
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      for (size_t i = 0; i < v.size; ++i) {
+        auto &e = v.slots[k][i];
+        if (e.v.v_ptr) {
+          e.v.v_ptr = translate(e.v.v_ptr);
+        }
       }
-      Topology::pmdk_pool()->persist(array_p[k]);
-      Topology::pmdk_pool()->persist(keys_p[k]);
     }
+#else
+    (void)translate;
+#endif
+    v.flush_to_raw_index(raw_index);
+    return v.size;
+  }
+
+  // where the view is recorded, OID_NULL if it is empty
+  PMEMoid record_oid() {
+    return record ? pmemobj_oid(record) : OID_NULL;
   }
 
   ~SPView() {
     for (int i = 0; i < Topology::kNumaCnt; ++i) {
-      if (array[i]) {
-        PMEMoid oid = pmemobj_oid(array[i]);
-        pmemobj_free(&oid);
-
+      if (slots[i] && pool) { // a recovered view owns none of its arrays
 #ifndef FIX_8_BYTE_VALUE
         for (size_t j = 0; j < size; ++j) {
-          if (array[i][j].v.v_ptr) {
-            cow_alloc.free(array[i][j].v.v_ptr);
+          if (slots[i][j].v.v_ptr) {
+            cow->free(slots[i][j].v.v_ptr);
           }
         }
 #endif
 
-        oid = pmemobj_oid(array[i][0].k);
-        pmemobj_free(&oid);
+        pool->put(i, (char *)slots_base[i], slots_cap[i], stamp);
       }
+      free(dirty[i]);
     }
-  }
 
-  struct AllocBuffer {
-    uint32_t size;
-    char *buf;
+    if (record && pool) {
+      pool->put(home_numa, (char *)record, keys_cap, stamp);
+    }
+  }
 
-    AllocBuffer() : size(0), buf(nullptr) {}
-  };
+  // PM address of the local slot, used to estimate write amplification
+  void *slot_addr(int index) { return &slots[Topology::numaID()][index]; }
 
-  constexpr static int kAllocBufferSize = 4;
-  AllocBuffer *get_thread_local_alloc_buf() {
-    static thread_local AllocBuffer free_array[kAllocBufferSize];
-    return free_array;
+  // PM bytes an update of a ``value_size`` value writes: the slot, plus the
+  // CoW value it points to
+  static size_t write_bytes(size_t value_size) {
+#ifdef FIX_8_BYTE_VALUE
+    (void)value_size;
+    return sizeof(SPSlot);
+#else
+    return sizeof(SPSlot) + value_size + sizeof(uint64_t) + sizeof(uint32_t);
+#endif
   }
 
+  constexpr static int kAllocBufferSize = CowAlloctor::kAllocBufferSize;
+
   char *alloc_before_update(const Slice &key, const Slice &value) {
 
 #ifdef FIX_8_BYTE_VALUE
@@ -114,19 +409,23 @@ public:
     auto buf_size = value.size() + sizeof(uint64_t) + sizeof(uint32_t);
     char *raw_ptr = nullptr;
 
-    auto *free_array = get_thread_local_alloc_buf();
+    auto *free_array = cow->thread_alloc_buf();
 
+    // buffers in pages the compactor evacuates are given back, so that the
+    // pages can become empty
     for (int i = 0; i < kAllocBufferSize; ++i) {
-      if (free_array[i].size >= buf_size) {
-        raw_ptr = free_array[i].buf;
-        free_array[i].size = 0;
-        free_array[i].buf = nullptr;
-        break;
+      auto &b = free_array[i];
+      if (b.buf && CowAlloctor::is_evacuating(b.buf)) {
+        cow->free(b.buf);
+        b = CowAlloctor::AllocBuffer();
+      } else if (!raw_ptr && b.size >= buf_size) {
+        raw_ptr = b.buf;
+        b = CowAlloctor::AllocBuffer();
       }
     }
 
     if (!raw_ptr) {
-      raw_ptr = (char *)cow_alloc.malloc(buf_size);
+      raw_ptr = (char *)cow->malloc(buf_size);
     }
 
     return raw_ptr;
@@ -137,49 +436,43 @@ public:
   void update(int index, char *ptr, const Slice &key, const Slice &value,
               uint64_t new_version, bool is_del = false) {
 
-#ifdef GLOBAL_VERSION
-    uint64_t v = get_version(key);
-#else
     uint64_t v = new_version;
-#endif
-
-   if (is_del) {
-     new_version = (1ull << 63) || new_version;
-   }
 
 #ifdef FIX_8_BYTE_VALUE
 
-    // leverage in cache-line ordering, two-incarnation toggle mechanism
-    auto &e = array[Topology::numaID()][index];
-    uint8_t idx = e.type == 2 ? 0 : ((e.type + 1) % 2);
+    // leverage in cache-line ordering, two-incarnation toggle mechanism:
+    // the value first, then the stamped version word which commits it.
+    auto &e = slots[Topology::numaID()][index];
+    int cur = newest(e);
+    int idx = cur == -1 ? 0 : 1 - cur;
 
-    e.ver[idx] = v;
-    e.v64[idx] = *(uint64_t *)value.data();
+    e.v64[idx] = is_del ? 0 : *(uint64_t *)value.data();
 
     compiler_barrier();
-    e.type = idx;
+    e.ver[idx] = make_ver(v) | (is_del ? kTombstone : 0);
 
-    persistent::clwb(&e.type);
+    persistent::clwb(&e);
     persistent::persistent_barrier();
-#else
-
-    auto buf_size = value.size() + sizeof(uint64_t) + sizeof(uint32_t);
 
-    *(uint64_t *)ptr = v;
-    *(uint32_t *)(ptr + sizeof(uint64_t)) = value.size();
-    memcpy(ptr + sizeof(uint64_t) + sizeof(uint32_t), value.data(),
-           value.size());
+    mark_dirty(Topology::numaID(), index);
+#else
 
-    persistent::clflushopt_range(ptr, buf_size);
+    if (ptr == nullptr) { // a tombstone, or the first write of a promoted key
+      ptr = alloc_before_update(key, is_del ? Slice::null() : value);
+    }
+    write_value(ptr, v, is_del ? Slice::null() : value, is_del);
 
-    auto &e = array[Topology::numaID()][index];
-    auto *free_array = get_thread_local_alloc_buf();
+    auto &e = slots[Topology::numaID()][index];
+    auto *free_array = cow->thread_alloc_buf();
     if (e.v.v_ptr) {
 
       char *freed_ptr = e.v.v_ptr;
       uint32_t free_size = *(uint32_t *)(e.v.v_ptr + sizeof(uint64_t)) +
                            sizeof(uint64_t) + sizeof(uint32_t);
-      for (int i = 0; i < kAllocBufferSize; ++i) {
+      if (CowAlloctor::is_evacuating(freed_ptr)) {
+        free_size = 0; // not kept, its page is being emptied
+      }
+      for (int i = 0; free_size && i < kAllocBufferSize; ++i) {
         if (free_array[i].size < free_size) {
           freed_ptr = free_array[i].buf;
           free_array[i].size = free_size;
@@ -189,69 +482,164 @@ public:
       }
 
       if (freed_ptr) {
-        cow_alloc.free(freed_ptr);
+        cow->free(freed_ptr);
       }
     }
 
     e.v.v_ptr = ptr;
     persistent::clwb_range(&e.v, sizeof(void *));
 
+    mark_dirty(Topology::numaID(), index);
+
 #endif
     // persistent::clflush(&e.v);
     // Topology::pmdk_pool()->persist(&e.v, sizeof(void *));
 
     // CHECK
-    // assert(e.k_size = key.size());
-    // assert(memcmp(e.k, key.data(), key.size()) == 0);
+    // assert(key_at(index) == key);
   }
   
 
-  // merge per-NUMA PM-resident PC-view into the raw index
-  template <class T> void flush_to_raw_index(T *raw_index) {
-    auto keys = array[0];
-    for (size_t i = 0; i < size; ++i) {
+#ifndef FIX_8_BYTE_VALUE
+  // versioned CoW write: | deleted, version | size | value |
+  static void write_value(char *ptr, uint64_t v, const Slice &value,
+                          bool is_del = false) {
+    auto buf_size = value.size() + sizeof(uint64_t) + sizeof(uint32_t);
+
+    *(uint64_t *)ptr = is_del ? (v | SPValue::kDeleted) : v;
+    *(uint32_t *)(ptr + sizeof(uint64_t)) = value.size();
+    if (value.size()) {
+      memcpy(ptr + sizeof(uint64_t) + sizeof(uint32_t), value.data(),
+             value.size());
+    }
 
-      uint64_t v_max = 0;
+    persistent::clflushopt_range(ptr, buf_size);
+  }
 
-#ifdef FIX_8_BYTE_VALUE
-      uint64_t v = (uint64_t)(-1);
-#else
-      SPValue v;
+  // move the values of slot ``index`` out of evacuating slab pages.
+  // the caller holds the CN-view entry lock of the key.
+  int relocate(int index) {
+    int relocated = 0;
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      auto &e = slots[k][index];
+      char *old_ptr = e.v.v_ptr;
+      if (old_ptr == nullptr || !CowAlloctor::is_evacuating(old_ptr)) {
+        continue;
+      }
+
+      auto buf_size =
+          e.v.get_size() + sizeof(uint64_t) + sizeof(uint32_t);
+      char *new_ptr = (char *)cow->malloc_at(k, buf_size);
+      write_value(new_ptr, e.v.get_version(),
+                  Slice(e.v.get_val(), e.v.get_size()), e.v.is_deleted());
+
+      __atomic_store_n(&e.v.v_ptr, new_ptr, __ATOMIC_RELEASE);
+      persistent::clwb_range(&e.v, sizeof(void *));
+
+      cow->free(old_ptr);
+      relocated++;
+    }
+    return relocated;
+  }
 #endif
+
+  Slice key_at(int index) {
+    return Slice(key_bytes + keys[index].off, keys[index].size);
+  }
+
+  // key of value slot ``i``, empty if it is a spare slot not handed out yet
+  Slice slot_key(size_t i) {
+    if (i < fixed_cnt) {
+      return key_at(i);
+    }
+    auto k = __atomic_load_n(&owner[i - fixed_cnt], __ATOMIC_ACQUIRE);
+    return k == kNoOwner ? Slice() : key_at(k);
+  }
+
+  // a spare value slot for the key ``key_index``, -1 if none is left.
+  // the caller holds the CN-view entry lock of the key.
+  int promote(int key_index) {
+    auto s = next_spare.fetch_add(1);
+    if (s >= spare_cnt) {
+      return -1;
+    }
+
+    __atomic_store_n(&owner[s], (uint32_t)key_index, __ATOMIC_RELEASE);
+    persistent::clwb(&owner[s]);
+    persistent::persistent_barrier();
+    return fixed_cnt + s;
+  }
+
+  size_t get_size() { return size; }
+
+  // merge per-NUMA PM-resident PC-view into the raw index. The puts go to
+  // the raw index as one batch, keys whose newest value is a tombstone are
+  // deleted after them. With a ``pacer``, the write-back is throttled by
+  // the bytes it writes.
+  template <class T>
+  void flush_to_raw_index(T *raw_index, FlushPacer *pacer = nullptr) {
+    std::vector<Slice> tombstones;
+    KVBatch batch;
+    collect_dirty(raw_index, batch, tombstones);
+
+    flush_puts(raw_index, batch, pacer);
+    flush_deletes(raw_index, tombstones, pacer);
+  }
+
+  // the puts and deletes of a write-back, the dirty bits are cleared. Only
+  // slots that are dirty on some NUMA node are visited, 256 slots are
+  // skipped at once if none of them is dirty.
+  template <class T>
+  void collect_dirty(T *raw_index, KVBatch &batch,
+                     std::vector<Slice> &tombstones) {
+    for (size_t w = 0; w < dirty_words; w += kWordsPerScan) {
+#ifdef __AVX2__
+      __m256i any = _mm256_setzero_si256();
       for (int k = 0; k < Topology::kNumaCnt; ++k) {
-#ifdef FIX_8_BYTE_VALUE
-        auto idx = array[k][i].type;
-        if (idx == 2) {
-          continue;
-        }
-        auto cur_val = array[k][i].v64[idx];
-        auto cur_ver = array[k][i].ver[idx];
-#else
-        auto &cur_val = array[k][i].v;
-        if (cur_val.v_ptr == nullptr) {
-          continue;
-        }
-        auto cur_ver = cur_val.get_version();
+        any = _mm256_or_si256(
+            any, _mm256_load_si256((const __m256i *)(dirty[k] + w)));
+      }
+      if (_mm256_testz_si256(any, any)) {
+        continue;
+      }
 #endif
+      for (size_t j = w; j < w + kWordsPerScan; ++j) {
+        uint64_t bits = 0;
+        for (int k = 0; k < Topology::kNumaCnt; ++k) {
+          bits |= dirty[k][j];
+        }
 
-        if (cur_ver > v_max) {
-          v_max = cur_ver;
-          v = cur_val;
+        while (bits) {
+          size_t i = j * 64 + __builtin_ctzll(bits);
+          bits &= bits - 1;
+
+          flush_slot(raw_index, i, tombstones, &batch);
         }
       }
+    }
+  }
 
-#ifdef FIX_8_BYTE_VALUE
-      if (v != (uint64_t)(-1)) {
-        raw_index->put(Slice(keys[i].k, keys[i].k_size),
-                       Slice((char *)&v, sizeof(uint64_t)), true);
+  // slot ``i`` holds a value not written back yet on some NUMA node
+  bool is_dirty(size_t i) {
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      if (__atomic_load_n(&dirty[k][i / 64], __ATOMIC_RELAXED) &
+          (1ull << (i % 64))) {
+        return true;
       }
-#else
-      if (v.v_ptr) {
-        raw_index->put(Slice(keys[i].k, keys[i].k_size),
-                       Slice(v.get_val(), v.get_size()), true);
+    }
+    return false;
+  }
+
+  size_t dirty_count() {
+    size_t cnt = 0;
+    for (size_t w = 0; w < dirty_words; ++w) {
+      uint64_t bits = 0;
+      for (int k = 0; k < Topology::kNumaCnt; ++k) {
+        bits |= dirty[k][w];
       }
-#endif
+      cnt += __builtin_popcountll(bits);
     }
+    return cnt;
   }
 
 private:
@@ -260,7 +648,11 @@ private:
 
     // SPValue() : v_ptr(nullptr) {}
 
-    uint64_t get_version() { return *(uint64_t *)v_ptr; }
+    constexpr static uint64_t kDeleted = 1ull << 63;
+
+    uint64_t get_version() { return *(uint64_t *)v_ptr & ~kDeleted; }
+
+    bool is_deleted() { return *(uint64_t *)v_ptr & kDeleted; }
 
     uint32_t get_size() { return *(uint32_t *)(v_ptr + sizeof(uint64_t)); }
 
@@ -268,26 +660,196 @@ private:
   };
   static_assert(sizeof(SPValue) == 8, "XX");
 
-  struct __attribute__((__packed__)) SPPair {
-    char *k;
-    uint32_t k_size;
-    uint32_t padding[3];
-    union {
-      struct {
-        SPValue v;
-      };
-      struct {
-        uint64_t type; // 0,1: vaild; 2: nullptr;
-        uint64_t ver[2];
-        uint64_t v64[2];
-      };
-    };
+  // offsets instead of pointers, the key buffer may be mapped elsewhere
+  struct __attribute__((__packed__)) SPKey {
+    uint32_t off; // from the end of the SPKey array
+    uint32_t size;
+  };
+  static_assert(sizeof(SPKey) == 8, "XX");
+  constexpr static uint32_t kNoOwner = UINT32_MAX;
+
+  // per-node value slot, the key lives in ``keys`` on the home node
+#ifdef FIX_8_BYTE_VALUE
+  struct __attribute__((__packed__)) SPSlot {
+    uint64_t ver[2]; // stamp << kStampShift | tombstone | version
+    uint64_t v64[2];
+  };
+  static_assert(sizeof(SPSlot) == 32, "XX");
+#else
+  struct __attribute__((__packed__)) SPSlot {
+    SPValue v;
   };
+  static_assert(sizeof(SPSlot) == 8, "XX");
+#endif
+
+  constexpr static int kSlotPerXPLine = kXPLineSize / sizeof(SPSlot);
+  // in-place versions keep the low bits of the clock only, which is enough:
+  // versions of a previous run are never compared with those of this run.
+  constexpr static int kStampShift = 64 - SPViewPool::kStampBits;
+  constexpr static uint64_t kVersionMask = (1ull << (kClockBits + 1)) - 1;
+  constexpr static uint64_t kTombstone = kVersionMask + 1;
 
-  static_assert(sizeof(SPPair) == 64, "XX");
+  uint64_t make_ver(uint64_t v) {
+    return ((uint64_t)(uint16_t)stamp << kStampShift) | (v & kVersionMask);
+  }
+
+  // the incarnation was written in this incarnation of the array
+  bool is_valid(uint64_t ver) {
+    return (ver >> kStampShift) == (uint16_t)stamp;
+  }
+
+#ifdef FIX_8_BYTE_VALUE
+  // index of the newest valid incarnation of ``e``, -1 if none
+  int newest(const SPSlot &e) {
+    bool v0 = is_valid(e.ver[0]);
+    bool v1 = is_valid(e.ver[1]);
+    if (v0 && v1) {
+      return (e.ver[1] & kVersionMask) > (e.ver[0] & kVersionMask) ? 1 : 0;
+    }
+    return v0 ? 0 : (v1 ? 1 : -1);
+  }
+#endif
+
+  // the newest value of slot ``i`` among all NUMA nodes, written back (or
+  // added to ``batch``) and marked clean. Returns the bytes of the put.
+  template <class T>
+  size_t flush_slot(T *raw_index, size_t i, std::vector<Slice> &tombstones,
+                    KVBatch *batch = nullptr) {
+    uint64_t v_max = 0;
+    bool found = false;
+    bool deleted = false;
+
+#ifdef FIX_8_BYTE_VALUE
+    const char *v = nullptr; // the old view is not written any more
+#else
+    SPValue v;
+#endif
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      if (!(dirty[k][i / 64] & (1ull << (i % 64)))) {
+        continue;
+      }
+      // foreground writers may set other bits of the word meanwhile
+      __atomic_fetch_and(&dirty[k][i / 64], ~(1ull << (i % 64)),
+                         __ATOMIC_RELAXED);
+
+#ifdef FIX_8_BYTE_VALUE
+      auto &e = slots[k][i];
+      int idx = newest(e);
+      if (idx == -1) {
+        continue;
+      }
+      auto cur_val = (const char *)&e.v64[idx];
+      auto cur_ver = e.ver[idx] & kVersionMask;
+      bool cur_del = e.ver[idx] & kTombstone;
+#else
+      auto &cur_val = slots[k][i].v;
+      if (cur_val.v_ptr == nullptr) {
+        continue;
+      }
+      auto cur_ver = cur_val.get_version();
+      bool cur_del = cur_val.is_deleted();
+#endif
+
+      if (!found || cur_ver > v_max) {
+        found = true;
+        v_max = cur_ver;
+        v = cur_val;
+        deleted = cur_del;
+      }
+    }
+
+    if (!found) {
+      return 0;
+    }
+
+    auto key = slot_key(i);
+    if (deleted) {
+      tombstones.push_back(key);
+      return 0;
+    }
+
+#ifdef FIX_8_BYTE_VALUE
+    Slice value(v, sizeof(uint64_t));
+#else
+    Slice value(v.get_val(), v.get_size());
+#endif
+    if (batch) {
+      batch->emplace_back(key, value);
+    } else {
+      raw_index->put(key, value, true);
+    }
+    return key.size() + value.size();
+  }
+
+  void mark_dirty(int numa_id, int index) {
+    auto &w = dirty[numa_id][index / 64];
+    uint64_t bit = 1ull << (index % 64);
+    if (!(__atomic_load_n(&w, __ATOMIC_RELAXED) & bit)) {
+      __atomic_fetch_or(&w, bit, __ATOMIC_RELAXED);
+    }
+  }
+
+  // the arrays of a view of a previous run, with all slots dirty
+  explicit SPView(ViewRecord *rec)
+      : pool(nullptr), cow(nullptr), record(rec),
+        keys((SPKey *)(rec + 1)), keys_cap(0), home_numa(rec->home_numa),
+        key_cnt(rec->key_cnt), fixed_cnt(rec->slot_cnt - rec->spare_cnt),
+        spare_cnt(rec->spare_cnt), next_spare(0), size(rec->slot_cnt),
+        stamp(rec->stamp) {
+    owner = (uint32_t *)(keys + key_cnt);
+    key_bytes = (char *)(owner + spare_cnt);
+    memset(&slots, 0, sizeof(slots));
+    memset(&slots_base, 0, sizeof(slots_base));
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      slots_base[k] = (SPSlot *)pmemobj_direct(rec->slots[k]);
+      slots[k] = (SPSlot *)(((uint64_t)slots_base[k] + kXPLineSize - 1) &
+                            (~(kXPLineSize - 1ull)));
+    }
+
+    alloc_dirty_bitmap();
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      for (size_t i = 0; i < size; ++i) {
+        dirty[k][i / 64] |= 1ull << (i % 64);
+      }
+    }
+  }
+
+  void alloc_dirty_bitmap() {
+    constexpr size_t kScanBytes = kWordsPerScan * sizeof(uint64_t);
+    dirty_words = (size + 64 * kWordsPerScan - 1) / (64 * kWordsPerScan) *
+                  kWordsPerScan;
+    for (int k = 0; k < Topology::kNumaCnt; ++k) {
+      dirty[k] = (uint64_t *)aligned_alloc(
+          kScanBytes, std::max(dirty_words * sizeof(uint64_t), kScanBytes));
+      memset(dirty[k], 0, dirty_words * sizeof(uint64_t));
+    }
+  }
 
-  SPPair *array[Topology::kNumaCnt];
-  size_t size;
+  SPViewPool *pool;
+  CowAlloctor *cow;
+  ViewRecord *record; // head of the key buffer
+
+  SPSlot *slots[Topology::kNumaCnt];      // aligned to XPLine
+  SPSlot *slots_base[Topology::kNumaCnt]; // taken from ``pool``
+  size_t slots_cap[Topology::kNumaCnt];
+
+  SPKey *keys; // on home_numa only
+  uint32_t *owner;
+  char *key_bytes;
+  size_t keys_cap;
+  int home_numa;
+
+  size_t key_cnt;   // keys of the view, with or without a value slot
+  size_t fixed_cnt; // keys [0, fixed_cnt) own value slots of the same index
+  size_t spare_cnt;
+  std::atomic<size_t> next_spare;
+
+  // per-NUMA DRAM bitmaps of slots updated since the last write-back
+  constexpr static size_t kWordsPerScan = 4; // one AVX2 register
+  uint64_t *dirty[Topology::kNumaCnt];
+  size_t dirty_words;
+  size_t size; // value slots
+  uint32_t stamp;
 };
 
 } // namespace nap
@@ -0,0 +1,63 @@
+#if !defined(_SPACE_SAVING_H_)
+#define _SPACE_SAVING_H_
+
+#include "hot_set_detector.h"
+#include "top_k.h"
+
+#include <algorithm>
+
+namespace nap {
+
+// Space-Saving: the candidates are counted exactly while they stay in the
+// heap, a new key evicts the one with the lowest count and inherits it
+// (plus one). Memory is O(K) and a reset clears the heap only, no sketch.
+// The heap keeps kSlack times the candidates asked for, so that the count
+// error stays below the hot set boundary.
+class SpaceSaving : public HotSetDetector {
+public:
+  SpaceSaving(int candidates, bool with_rings = true)
+      : HotSetDetector(with_rings), topK(candidates * kSlack) {}
+
+  std::vector<Node> &get_list() override { return topK.get_list(); }
+
+  void set_candidates(int k) override { topK.set_capacity(k * kSlack); }
+
+  void reset() override { topK.reset(); }
+
+  // keys out of the heap are taken as not accessed
+  uint32_t query(const Slice &key) override {
+    int cnt = topK.count_of(key_fingerprint(key));
+    return cnt < 0 ? 0 : cnt;
+  }
+
+  // counts of keys in both heaps add up, the others keep their own
+  void merge(HotSetDetector &o) override {
+    auto &other = static_cast<SpaceSaving &>(o);
+    topK.recount([&other](const Node &n) {
+      return n.cnt + std::max(other.topK.count_of(n.fp), 0);
+    });
+    auto &l = other.get_list();
+    for (size_t i = 1; i < l.size(); ++i) {
+      int cnt = topK.count_of(l[i].fp);
+      topK.merge(l[i], cnt < 0 ? l[i].cnt : cnt);
+    }
+  }
+
+  void access(const SampledAccess &a) override {
+    auto fp = key_fingerprint(a.key);
+    int cnt = topK.count_of(fp);
+    if (cnt < 0) {
+      cnt = topK.is_full() ? topK.min_count() : 0;
+    }
+    topK.access_a_key(a.key, fp, cnt + a.cnt, a.writes, a.numa, a.cnt);
+  }
+
+private:
+  constexpr static int kSlack = 2;
+
+  TopK topK;
+};
+
+} // namespace nap
+
+#endif // _SPACE_SAVING_H_
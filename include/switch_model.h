@@ -0,0 +1,154 @@
+#if !defined(_SWITCH_MODEL_H_)
+#define _SWITCH_MODEL_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+namespace nap {
+
+// what a switch to a candidate hot set would gain and cost
+struct SwitchInput {
+  double gain;        // sampled remote accesses per window saved over cur set
+  double sample_rate; // accesses per sampled one
+  size_t dirty_slots; // NAL slots the current epoch writes back
+  size_t kept_keys;   // keys relocated from the current epoch
+  size_t new_keys;    // keys lazily loaded from the raw index
+};
+
+// Decides whether the shift thread switches to a new hot set: the remote
+// accesses it saves over the expected lifetime of an epoch against the
+// write-back and relocation work of the switch. Per-unit costs are measured
+// on every switch. A switch needs the benefit to win kHysteresisRounds
+// windows in a row (or by far, once), so that a transient burst does not
+// churn the hot set.
+class SwitchModel {
+public:
+  void set_remote_access_ns(double ns) { remote_access_ns = ns; }
+
+  void set_log(bool on) { log = on; }
+
+  bool log_enabled() const { return log; }
+
+  void observe_flush(size_t slots, uint64_t ns) {
+    if (slots) {
+      flush_slot_ns = ewma(flush_slot_ns, (double)ns / slots);
+    }
+  }
+
+  void observe_relocate(size_t keys, uint64_t ns) {
+    if (keys) {
+      relocate_key_ns = ewma(relocate_key_ns, (double)ns / keys);
+    }
+  }
+
+  // ``urgent``: the window was cut short by a hit ratio drop, the benefit
+  // need not win twice in a row.
+  bool decide(uint64_t epoch, const SwitchInput &in, bool urgent = false) {
+    windows_since_switch++;
+
+    double benefit = in.gain * in.sample_rate * remote_access_ns *
+                     std::max(epoch_windows, 1.0);
+    // a lazy load from the raw index costs about a write-back of a slot
+    double cost = (in.dirty_slots + in.new_keys) * flush_slot_ns +
+                  in.kept_keys * relocate_key_ns;
+    double ratio = benefit / std::max(cost, 1.0);
+
+    streak = ratio >= kSwitchRatio ? streak + 1 : 0;
+    bool res = ratio >= kUrgentRatio || streak >= kHysteresisRounds ||
+               (urgent && ratio >= kSwitchRatio);
+
+    if (log) {
+      printf("nap switch decision [epoch %lu]: benefit %.0f us (gain %.0f, "
+             "horizon %.1f) cost %.0f us (dirty %lu, kept %lu, new %lu, "
+             "%.0f/%.0f ns) streak %d%s -> %s\n",
+             epoch, benefit / 1000, in.gain, std::max(epoch_windows, 1.0),
+             cost / 1000, in.dirty_slots, in.kept_keys, in.new_keys,
+             flush_slot_ns, relocate_key_ns, streak, urgent ? " urgent" : "",
+             res ? "switch" : "stay");
+    }
+
+    if (res) {
+      epoch_windows = ewma(epoch_windows, windows_since_switch);
+      windows_since_switch = 0;
+      streak = 0;
+    }
+    return res;
+  }
+
+private:
+  static double ewma(double old_v, double v) {
+    return old_v * (1 - kAlpha) + v * kAlpha;
+  }
+
+  constexpr static double kAlpha = 0.25;
+  constexpr static double kSwitchRatio = 2.0;
+  constexpr static double kUrgentRatio = 8.0;
+  constexpr static int kHysteresisRounds = 2;
+
+  // initial guesses, replaced by measurements
+  double flush_slot_ns{1000};
+  double relocate_key_ns{200};
+  double remote_access_ns{300};
+
+  double epoch_windows{1}; // how many windows an epoch lasts
+  int windows_since_switch{0};
+  int streak{0};
+  bool log{false};
+};
+
+// Length of the detection window, within [min, max]: it grows while the
+// candidates keep overlapping the current hot set and shrinks when they
+// drift away. A window also ends early once the hit ratio of the current
+// hot set falls below ``hit_ratio_floor``.
+class IntervalTuner {
+public:
+  void enable(double min_s, double max_s, double hit_ratio_floor) {
+    min_window = min_s;
+    max_window = max_s;
+    hit_floor = hit_ratio_floor;
+    window = std::min(std::max(window, min_s), max_s);
+    enabled = true;
+  }
+
+  bool is_enabled() const { return enabled; }
+
+  double get_window() const { return window; }
+
+  double get_min_window() const { return min_window; }
+
+  // ``overlap``: share of the candidates already in the current hot set
+  void on_window(double overlap, bool cut_short) {
+    if (!enabled) {
+      return;
+    }
+    if (cut_short || overlap < kDriftOverlap) {
+      window = std::max(min_window, window / kShrink);
+    } else if (overlap >= kStableOverlap) {
+      window = std::min(max_window, window * kGrow);
+    }
+  }
+
+  bool hit_ratio_low(uint64_t ops, uint64_t hits) const {
+    return hits < hit_floor * ops;
+  }
+
+  // fewer operations tell nothing about the hit ratio
+  constexpr static uint64_t kMinOps = 1000;
+
+private:
+  constexpr static double kStableOverlap = 0.9;
+  constexpr static double kDriftOverlap = 0.5;
+  constexpr static double kGrow = 1.5;
+  constexpr static double kShrink = 2;
+
+  bool enabled{false};
+  double window{5.0};
+  double min_window{5.0};
+  double max_window{5.0};
+  double hit_floor{0};
+};
+
+} // namespace nap
+
+#endif // _SWITCH_MODEL_H_
@@ -1,9 +1,13 @@
 #if !defined(_NAP_HEAP_H_)
 #define _NAP_HEAP_H_
 
+#include "murmur_hash2.h"
+#include "nap_common.h"
+#include "slice.h"
+
+#include <algorithm>
 #include <cassert>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
 namespace nap
@@ -11,9 +15,26 @@ namespace nap
 
 struct Node {
 	std::string key;
+	uint64_t fp; // fingerprint of the key, what the heap looks keys up by
 	int cnt;
-	Node(const std::string &s, int c) : key(s), cnt(c)
+	int w_cnt; // sampled writes since the key entered the heap
+	int numa_cnt[kMaxNumaCnt]; // sampled accesses per socket, ditto
+	Node(const std::string &s, int c, bool is_write = false, int numa = 0)
+	    : key(s), fp(0), cnt(c), w_cnt(is_write ? 1 : 0), numa_cnt{}
+	{
+		numa_cnt[numa] = 1;
+	}
+
+	// share of the sampled accesses that come from sockets other than
+	// ``home``
+	double
+	remote_share(int home, int nodes) const
 	{
+		int total = 0;
+		for (int i = 0; i < nodes; ++i) {
+			total += numa_cnt[i];
+		}
+		return total ? (double)(total - numa_cnt[home]) / total : 0;
 	}
 	bool
 	operator<(const Node &other) const
@@ -27,18 +48,116 @@ swapNode(Node &a, Node &b)
 {
 	// std::swap(a, b);
 	std::swap(a.cnt, b.cnt);
+	std::swap(a.w_cnt, b.w_cnt);
+	std::swap(a.numa_cnt, b.numa_cnt);
+	std::swap(a.fp, b.fp);
 	a.key.swap(b.key);
 }
 
+// 64-bit fingerprint of a key, never 0 (the empty slot of the position
+// table)
+inline uint64_t
+key_fingerprint(const Slice &key)
+{
+	uint64_t fp = MurmurHash64A(key.data(), key.size(), 0x6b0f2a3d);
+	return fp ? fp : 1;
+}
+
+// Min heap of the K most frequent keys. Keys are looked up by their
+// fingerprint in an open-addressing table of heap positions, so that a
+// sample of a key in the heap neither builds nor hashes a string. A key is
+// copied into its node only when it enters the heap. Table slots carry the
+// generation of the last reset, which makes a reset O(1) for the table.
 class TopK {
 private:
-	std::unordered_map<std::string, int> offsetMap;
+	struct Slot {
+		uint64_t fp;
+		int pos;
+		uint32_t gen;
+	};
+
 	std::vector<Node> minHeap;
 	int size;
 	int K;
 
+	std::vector<Slot> table;
+	size_t table_mask;
+	uint32_t gen;
+
+	void
+	resize_table()
+	{
+		size_t cap = 16;
+		while (cap < 2 * (size_t)(K + 1)) {
+			cap <<= 1;
+		}
+		if (cap != table.size()) {
+			table.assign(cap, Slot{0, 0, 0});
+			table_mask = cap - 1;
+			gen = 0;
+		}
+	}
+
+	bool
+	is_used(const Slot &s) const
+	{
+		return s.gen == gen && s.fp != 0;
+	}
+
+	// the slot of ``fp``, or the empty one where it would go
+	size_t
+	find_slot(uint64_t fp) const
+	{
+		size_t i = fp & table_mask;
+		while (is_used(table[i]) && table[i].fp != fp) {
+			i = (i + 1) & table_mask;
+		}
+		return i;
+	}
+
+	void
+	set_pos(uint64_t fp, int pos)
+	{
+		auto &s = table[find_slot(fp)];
+		s.fp = fp;
+		s.pos = pos;
+		s.gen = gen;
+	}
+
+	// backward-shift deletion, keeps the probe chains intact
+	void
+	erase(uint64_t fp)
+	{
+		size_t i = find_slot(fp);
+		if (!is_used(table[i])) {
+			return;
+		}
+		table[i].fp = 0;
+
+		size_t j = i;
+		while (true) {
+			j = (j + 1) & table_mask;
+			if (!is_used(table[j])) {
+				break;
+			}
+			size_t home = table[j].fp & table_mask;
+			if (((i - home) & table_mask) < ((j - home) & table_mask)) {
+				table[i] = table[j];
+				table[j].fp = 0;
+				i = j;
+			}
+		}
+	}
+
+	int
+	lookup(uint64_t fp) const
+	{
+		auto &s = table[find_slot(fp)];
+		return is_used(s) ? s.pos : -1;
+	}
+
 public:
-	TopK(int k) : K(k)
+	TopK(int k) : K(k), table_mask(0), gen(0)
 	{
 		reset();
 	}
@@ -48,9 +167,24 @@ public:
 	{
 		minHeap.clear();
 		assert(minHeap.size() == 0);
+		minHeap.reserve(K + 1);
 		minHeap.push_back({"FENCE_KEY", 0});
-		offsetMap.clear();
 		size = 1;
+
+		resize_table();
+		if (++gen == 0) { // wrapped, stale slots could look valid
+			for (auto &s : table) {
+				s.gen = 0;
+			}
+			gen = 1;
+		}
+	}
+
+	// takes effect at the next reset
+	void
+	set_capacity(int k)
+	{
+		K = k;
 	}
 
 	std::vector<Node> &
@@ -59,53 +193,112 @@ public:
 		return minHeap;
 	}
 
-	void
-	access_a_key(const std::string &key, int freq)
+	// count of the key in the heap, -1 if it is not there
+	int
+	count_of(uint64_t fp) const
 	{
-		// if (minHeap.size() > 2 && minHeap[1].key == "") {
-		// 	assert(false);
-		// }
-		auto it = offsetMap.find(key);
+		int i = lookup(fp);
+		return i < 0 ? -1 : minHeap[i].cnt;
+	}
 
-		if (it != offsetMap.end()) {
-			int i = it->second;
+	int
+	count_of(const std::string &key) const
+	{
+		return count_of(key_fingerprint(key));
+	}
+
+	bool
+	is_full() const
+	{
+		return size > K;
+	}
+
+	int
+	min_count() const
+	{
+		return size > 1 ? minHeap[1].cnt : 0;
+	}
+
+	// ``accesses`` samples of the key, ``writes`` of them writes, from
+	// socket ``numa``; ``freq`` is its new estimated count
+	void
+	access_a_key(const Slice &key, uint64_t fp, int freq, int writes = 0,
+		     int numa = 0, int accesses = 1)
+	{
+		int i = lookup(fp);
 
-			// if (minHeap[i].cnt >= freq) {
-			// 	printf("%d %d\n", minHeap[i].cnt, freq);
-			// 	assert(false);
-			// }
-			// printf("ZZZ\n");
+		if (i >= 0) {
 			minHeap[i].cnt = freq;
+			minHeap[i].w_cnt += writes;
+			minHeap[i].numa_cnt[numa] += accesses;
 			shiftDown(i);
 		} else if (size <= K) {
-			minHeap.push_back(Node(key, freq));
-			offsetMap[key] = size;
-
-			// printf("heap size %d\n", minHeap.size());
+			minHeap.push_back(Node(key.ToString(), freq, false, numa));
+			auto &n = minHeap.back();
+			n.fp = fp;
+			n.w_cnt = writes;
+			n.numa_cnt[numa] = accesses;
+			set_pos(fp, size);
 
 			shiftUp(size++);
-
-			// assert(minHeap.size() == size);
 		} else if (minHeap[1].cnt < freq) {
-			minHeap[1] = Node(key, freq);
-			// printf("XX\n");
+			erase(minHeap[1].fp);
+
+			// reuses the buffer of the evicted key
+			auto &n = minHeap[1];
+			n.key.assign(key.data(), key.size());
+			n.fp = fp;
+			n.cnt = freq;
+			n.w_cnt = writes;
+			std::fill(std::begin(n.numa_cnt), std::end(n.numa_cnt), 0);
+			n.numa_cnt[numa] = accesses;
+			set_pos(fp, 1);
 
 			shiftDown(1);
 		}
+	}
+
+	void
+	access_a_key(const std::string &key, int freq, bool is_write = false,
+		     int numa = 0)
+	{
+		access_a_key(key, key_fingerprint(key), freq, is_write, numa);
+	}
+
+	// the candidate ``n`` of another heap, ``freq`` is its merged count
+	void
+	merge(const Node &n, int freq)
+	{
+		access_a_key(n.key, n.fp, freq, n.w_cnt, 0, n.numa_cnt[0]);
+
+		int i = lookup(n.fp);
+		if (i >= 0) {
+			for (int k = 1; k < kMaxNumaCnt; ++k) {
+				minHeap[i].numa_cnt[k] += n.numa_cnt[k];
+			}
+		}
+	}
 
-		// if (minHeap.size() > 2 && minHeap[1].key == "") {
-		// 	assert(false);
-		// }
+	// set the count of every candidate to ``count(node)``
+	template <class F>
+	void
+	recount(F count)
+	{
+		for (int i = 1; i < size; ++i) {
+			minHeap[i].cnt = count(minHeap[i]);
+		}
+		for (int i = (size - 1) / 2; i >= 1; --i) {
+			shiftDown(i);
+		}
 	}
 
 	void
 	shiftUp(int i)
 	{
-		// assert(i <= size);
 		while (i > 1 && minHeap[i] < minHeap[i / 2]) {
 			swapNode(minHeap[i], minHeap[i / 2]);
-			offsetMap[minHeap[i / 2].key] = i / 2;
-			offsetMap[minHeap[i].key] = i;
+			set_pos(minHeap[i / 2].fp, i / 2);
+			set_pos(minHeap[i].fp, i);
 			i >>= 1;
 		}
 	}
@@ -113,15 +306,14 @@ public:
 	void
 	shiftDown(int i)
 	{
-		// assert(i <= size);
 		while ((i = i * 2) < size) {
 			if (i + 1 < size && minHeap[i + 1] < minHeap[i]) {
 				++i;
 			}
 			if (minHeap[i] < minHeap[i / 2]) {
 				swapNode(minHeap[i], minHeap[i / 2]);
-				offsetMap[minHeap[i / 2].key] = i / 2;
-				offsetMap[minHeap[i].key] = i;
+				set_pos(minHeap[i / 2].fp, i / 2);
+				set_pos(minHeap[i].fp, i);
 			} else {
 				break;
 			}
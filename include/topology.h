@@ -24,14 +24,19 @@
 
 #include "nap_common.h"
 
-inline void bindCore(uint16_t core) {
-
+// the CPU of the core a thread ID runs on
+inline uint16_t cpuOfCore(uint16_t core) {
 #if 1
   if (core % 2 == 0) core = core/2;
   else core = core/2 + 32;
 #endif
   if (core >=16 && core < 32) core += 16;
   else if (core >=32 && core < 48) core -= 16;
+  return core;
+}
+
+inline void bindCore(uint16_t core) {
+  core = cpuOfCore(core);
   printf("bind to %d\n", core);
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
@@ -47,8 +52,8 @@ inline void bindCore(uint16_t core) {
 extern int numa_map[nap::kMaxThreadCnt];
 namespace nap {
 
-extern pmem::obj::pool_base nap_pop_numa[kMaxNumaCnt];
-
+// Thread IDs are shared by all Nap instances of the process: a thread
+// indexes the per-thread state of every instance by the same ID.
 class Topology {
 
   static std::atomic<int> counter;
@@ -67,14 +72,31 @@ public:
     // id 0 is shift thread
   }
 
-  static int numaID() { return (threadID() / kCorePerNuma) % kNumaCnt; }
+  static int numaID() { return numaOf(threadID()); }
 
-  static pmem::obj::pool_base *pmdk_pool() { return nap_pop_numa + numaID(); }
-
-  static pmem::obj::pool_base *pmdk_pool_at(int numa_id) {
-    return nap_pop_numa + numa_id;
+  static int numaOf(int thread_id) {
+    return (thread_id / kCorePerNuma) % kNumaCnt;
   }
 };
 } // namespace nap
 
+// bind to any core of a socket, for background threads which should not
+// take the core of a worker
+inline void bindNuma(int numa) {
+  using nap::Topology;
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  for (int id = 0; id < Topology::kNumaCnt * Topology::kCorePerNuma; ++id) {
+    if (Topology::numaOf(id) == numa) {
+      CPU_SET(cpuOfCore(id), &cpuset);
+    }
+  }
+  printf("bind to numa %d\n", numa);
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+  if (rc != 0) {
+    printf("can't bind numa %d!", numa);
+    exit(-1);
+  }
+}
+
 #endif // _TOPOLOGY_H_
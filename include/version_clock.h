@@ -0,0 +1,45 @@
+#if !defined(_VERSION_CLOCK_H_)
+#define _VERSION_CLOCK_H_
+
+#include "nap_common.h"
+#include "topology.h"
+
+#include <algorithm>
+
+namespace nap {
+
+// | boot epoch | clock (kClockBits) |
+constexpr int kClockBits = 46;
+constexpr uint64_t kClockMask = (1ull << kClockBits) - 1;
+
+// Versions of GLOBAL_VERSION mode: a per-thread logical clock, no shared
+// atomic per write. A writer holds the entry lock of the key and passes the
+// last version of the key, so that versions of one key only grow, whichever
+// thread or socket writes it. The boot epoch, persisted across restarts,
+// orders versions of a previous run before all versions of this one. One
+// clock per Nap instance, seeded from the boot counter of its own pools.
+class VersionClock {
+public:
+  void set_boot_epoch(uint64_t boot) { boot_epoch = boot << kClockBits; }
+
+  uint64_t tick(uint64_t last) {
+    auto &c = clocks[Topology::threadID()].c;
+    if ((last & ~kClockMask) == boot_epoch) {
+      c = std::max(c, last & kClockMask);
+    }
+    c++;
+    return boot_epoch | c;
+  }
+
+private:
+  struct alignas(kCachelineSize) Clock {
+    uint64_t c;
+  };
+
+  uint64_t boot_epoch{0};
+  Clock clocks[kMaxThreadCnt];
+};
+
+} // namespace nap
+
+#endif // _VERSION_CLOCK_H_
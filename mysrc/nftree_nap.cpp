@@ -297,6 +297,31 @@ int main(int argc, char *argv[]) {
     nap::Topology::reset();
 
     nftree_nap.set_sampling_interval(32);
+#ifdef XPLINE_LAYOUT
+    nftree_nap.set_slot_layout(nap::SLOT_XPLINE_HOTNESS);
+#endif
+#ifdef LOCALITY_AWARE
+    nftree_nap.set_locality_aware(true);
+#endif
+#ifdef READ_ONLY_ENTRIES
+    nftree_nap.set_read_only_entries(true);
+#endif
+#ifdef PREDICT_HOT_SET
+    nftree_nap.set_prediction(true);
+#endif
+#ifdef TRICKLE_WRITE_BACK
+    nftree_nap.set_trickle_write_back(true);
+#endif
+#ifdef NUMA_AGGREGATION
+    nftree_nap.set_numa_aggregation(true);
+#endif
+#ifdef FLUSH_RATE_MB
+    nftree_nap.set_flush_rate(FLUSH_RATE_MB * 1024ull * 1024);
+#ifdef FLUSH_P99_TARGET_NS
+    nftree_nap.set_flush_latency_target(FLUSH_P99_TARGET_NS,
+                                        FLUSH_RATE_MB * 1024ull * 1024 / 8);
+#endif
+#endif
 #endif
     fclose(ycsb);
   }
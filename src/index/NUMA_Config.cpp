@@ -75,3 +75,21 @@ void index_pmem_free(void *ptr)
   auto f_oid = pmemobj_oid(ptr);
   pmemobj_free(&f_oid);
 }
+
+int index_numa_of(const void *ptr)
+{
+  if (ptr == nullptr)
+  {
+    return -1;
+  }
+
+  auto *pop = pmemobj_pool_by_ptr(ptr);
+  for (int i = 0; i < nap::Topology::kNumaCnt; ++i)
+  {
+    if (pop_numa[i].handle() == pop)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
@@ -512,12 +512,12 @@ leaf_retry:
 }
 
 void masstree::put(const char *key, uint64_t value,
-                   ThreadInfo &threadEpocheInfo) {
+                   ThreadInfo &threadEpocheInfo, leafnode **leaf_hint) {
   EpocheGuard epocheGuard(threadEpocheInfo);
   void *root = NULL;
   key_indexed_position kx_;
   uint32_t depth = 0;
-  leafnode *next = NULL, *p = NULL;
+  leafnode *next = NULL, *p = NULL, *l = NULL;
   leafvalue *lv = make_leaf(key, strlen(key), value);
   void *snapshot_v = NULL;
 
@@ -529,6 +529,13 @@ restart:
   depth = 0;
   p = reinterpret_cast<leafnode *>(root);
 
+  if (leaf_hint && *leaf_hint) {
+    // the leaf of the previous (smaller) key is a lower bound of this one
+    l = *leaf_hint;
+    *leaf_hint = NULL; // a restart goes from the root
+    goto leaf_retry;
+  }
+
 from_root:
   while (p->level() != 0) {
   inter_retry:
@@ -570,7 +577,7 @@ from_root:
       p = reinterpret_cast<leafnode *>(snapshot_v);
   }
 
-  leafnode *l = reinterpret_cast<leafnode *>(p);
+  l = reinterpret_cast<leafnode *>(p);
 leaf_retry:
   next = l->advance_to_key(lv->fkey[depth]);
   if (next != l) {
@@ -600,6 +607,10 @@ leaf_retry:
     goto leaf_retry;
   }
 
+  if (leaf_hint && depth == 0) {
+    *leaf_hint = l;
+  }
+
   l->prefetch();
   fence();
 
@@ -1835,6 +1846,12 @@ leaf_retry:
 }
 
 void *masstree::get(const char *key, ThreadInfo &threadEpocheInfo) {
+  leafvalue *lv = get_leafvalue(key, threadEpocheInfo);
+  return lv ? (void *)lv->value : NULL;
+}
+
+leafvalue *masstree::get_leafvalue(const char *key,
+                                   ThreadInfo &threadEpocheInfo) {
   EpocheGuard epocheGuard(threadEpocheInfo);
   void *root = NULL;
   key_indexed_position kx_;
@@ -1929,11 +1946,9 @@ leaf_retry:
     goto leaf_retry;
   else {
     if (snapshot_v) {
-      if (((leafvalue *)(snapshot_v))->key_len == lv->key_len &&
-          memcmp(((leafvalue *)(snapshot_v))->fkey, lv->fkey, lv->key_len) ==
+      if (((leafvalue *)(snapshot_v))->key_len != lv->key_len ||
+          memcmp(((leafvalue *)(snapshot_v))->fkey, lv->fkey, lv->key_len) !=
               0) {
-        snapshot_v = (void *)(((leafvalue *)(snapshot_v))->value);
-      } else {
         snapshot_v = NULL;
       }
     } else {
@@ -1963,7 +1978,7 @@ leaf_retry:
 #endif
     }
 
-    return snapshot_v;
+    return (leafvalue *)snapshot_v;
   }
 }
 
@@ -2,10 +2,7 @@
 
 namespace nap {
 
-pmem::obj::pool_base nap_pop_numa[kMaxNumaCnt];
-ThreadMeta thread_meta_array[kMaxThreadCnt];
-
-CowAlloctor *cow_alloc;
+ShiftScheduler shift_scheduler;
 
 
 } // namespace nap
@@ -0,0 +1,91 @@
+// long-running churn of mixed-size values over a shifting hot set,
+// reports the PM bytes held by the CoW alloctor over time.
+#define VAR_LENGTH_VALUE
+
+#include "index/mock_index.h"
+#include "nap.h"
+
+#include <thread>
+
+#include "zipf.h"
+
+std::thread th[100];
+
+nap::Nap<nap::MockIndex> *index_ptr;
+
+constexpr uint64_t kShiftNs = 1000ull * 1000 * 1000 * 5;
+constexpr uint64_t kMaxValueSize = 400;
+
+void thread_write(int id) {
+  bindCore(nap::Topology::threadID());
+
+  auto &index = *index_ptr;
+
+  struct zipf_gen_state state;
+
+  mehcached_zipf_init(&state, 1024ull * 1024 * 1024, 0.99, id * 12312312);
+
+  uint32_t seed = id * 123231;
+  char value_buf[kMaxValueSize];
+  memset(value_buf, id, sizeof(value_buf));
+
+  nap::Timer timer;
+  uint64_t center = 0;
+
+  timer.begin();
+
+  std::string str;
+  uint64_t count = 0;
+  while (true) {
+    uint64_t k = mehcached_zipf_next(&state) + center;
+
+    auto key = std::string((char *)&k, sizeof(uint64_t));
+
+    if (rand_r(&seed) % 100 < 50) {
+      // all four slab classes
+      auto value_size = 8 + rand_r(&seed) % (kMaxValueSize - 8);
+      index.put(key, nap::Slice(value_buf, value_size));
+    } else {
+      index.get(key, str);
+    }
+
+    if (count++ % 10 == 0 && timer.end() > kShiftNs) {
+      timer.begin();
+      center += 1024 * 1024;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc != 3) {
+    printf("usage: ./exe thread_num seconds\n");
+    exit(-1);
+  }
+
+  int kWriteThread = std::atoi(argv[1]);
+  int kSeconds = std::atoi(argv[2]);
+
+  nap::MockIndex raw_index;
+
+  nap::Nap<nap::MockIndex> index(&raw_index);
+  index_ptr = &index;
+
+  index.set_switch_interval(1.0);
+
+  for (int i = 0; i < kWriteThread; ++i) {
+    th[i] = std::thread(thread_write, i);
+  }
+
+  // time (s), PM bytes (MB)
+  for (int s = 1; s <= kSeconds; ++s) {
+    sleep(1);
+    printf("%d %lu\n", s, index.pm_bytes() / 1024 / 1024);
+    fflush(stdout);
+  }
+
+  index.show_statistics();
+  exit(0);
+
+  return 0;
+}
@@ -0,0 +1,82 @@
+// several Nap instances in one process, each with pools of its own. every
+// thread writes to all of them, a value tells the instance it was written
+// to, so that a value read from another instance's PM is caught.
+#include "index/mock_index.h"
+#include "nap.h"
+
+#include <thread>
+
+#include "zipf.h"
+
+std::thread th[100];
+
+constexpr int kMaxInstances = 16;
+constexpr size_t kPoolSize = 1ull * 1024 * 1024 * 1024;
+
+nap::MockIndex raw_index[kMaxInstances];
+nap::Nap<nap::MockIndex> *index_ptr[kMaxInstances];
+int kInstances = 0;
+
+void thread_write(int id) {
+  bindCore(nap::Topology::threadID());
+
+  struct zipf_gen_state state;
+
+  mehcached_zipf_init(&state, 1024ull * 1024 * 1024, 0.99, id * 12312312);
+
+  uint32_t seed = id * 123231;
+
+  std::string str;
+  while (true) {
+    uint64_t k = mehcached_zipf_next(&state);
+    auto key = std::string((char *)&k, sizeof(uint64_t));
+
+    int i = rand_r(&seed) % kInstances;
+    auto &index = *index_ptr[i];
+    if (rand_r(&seed) % 100 < 5) {
+      uint64_t v = k * kMaxInstances + i;
+      index.put(key, std::string((char *)&v, sizeof(uint64_t)));
+    } else if (index.get(key, str)) {
+      uint64_t v = *(uint64_t *)str.data();
+      if (v % kMaxInstances != (uint64_t)i) {
+        printf("instance %d returned a value of instance %lu for key %lu\n",
+               i, v % kMaxInstances, k);
+        exit(1);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc != 4) {
+    printf("usage: ./exe thread_num instance_num seconds\n");
+    exit(-1);
+  }
+
+  int kWriteThread = std::atoi(argv[1]);
+  kInstances = std::min(std::atoi(argv[2]), kMaxInstances);
+  int kSeconds = std::atoi(argv[3]);
+
+  for (int i = 0; i < kInstances; ++i) {
+    auto path = "/mnt/pmem%d/nap_" + std::to_string(i);
+    index_ptr[i] = new nap::Nap<nap::MockIndex>(
+        &raw_index[i], nap::kHotKeys, nap::NAL_IN_PLACE,
+        nap::kDefaultDetector, nap::kDefaultShiftMode, path, kPoolSize);
+    index_ptr[i]->set_switch_interval(1.0);
+  }
+
+  for (int i = 0; i < kWriteThread; ++i) {
+    th[i] = std::thread(thread_write, i);
+  }
+
+  sleep(kSeconds);
+
+  for (int i = 0; i < kInstances; ++i) {
+    printf("instance %d:\n", i);
+    index_ptr[i]->show_statistics();
+  }
+  exit(0);
+
+  return 0;
+}
@@ -141,12 +141,16 @@ void thread_write(int id) {
 
 int main(int argc, char *argv[]) {
 
-  if (argc != 2) {
-    printf("usage: ./exe thread_num\n");
+  if (argc != 2 && argc != 3) {
+    printf("usage: ./exe thread_num [in_place|log]\n");
     exit(-1);
   }
 
   kWriteThread = std::atoi(argv[1]);
+  auto nal_mode = nap::NAL_IN_PLACE;
+  if (argc == 3 && std::string(argv[2]) == "log") {
+    nal_mode = nap::NAL_LOG;
+  }
 
   nap::MockIndex raw_index;
   for (uint64_t k = 0; k < 102400; ++k) {
@@ -154,7 +158,7 @@ int main(int argc, char *argv[]) {
     raw_index.put(key, key, false);
   }
 
-  nap::Nap<nap::MockIndex> index(&raw_index);
+  nap::Nap<nap::MockIndex> index(&raw_index, nap::kHotKeys, nal_mode);
   index_ptr = &index;
 
   // for (int k = 0; k < 70; ++k) {
@@ -1,13 +1,17 @@
+#include "blocked_count_min.h"
 #include "count_min_sketch.h"
+#include "space_saving.h"
 
 #include <algorithm>
+#include <atomic>
 #include <thread>
+#include <unordered_map>
 
 #include "zipf.h"
 
 #define kKeySpace (1024ull * 1024 * 1024)
 
-nap::CountMin *CM;
+nap::HotSetDetector *CM;
 
 constexpr int kAccessThread = 16;
 void access_thread(int i) {
@@ -63,9 +67,151 @@ void background_thread() {
   }
 }
 
-int main() {
+// single-threaded cost per sample of the sketches and the share of their
+// candidates which are among the exact top keys, on one window of Zipf 0.99
+// samples fed in poll-sized batches. Then the same samples split over two
+// sockets' detectors which are merged, as with per-NUMA aggregation.
+void bench_sketches() {
+  constexpr uint64_t kSamples = 16ull * 1024 * 1024;
+  constexpr int kBatch = 8;
+  constexpr int kCandidates = 100000;
 
-  CM = new nap::CountMin(100000);
+  struct zipf_gen_state state;
+  mehcached_zipf_init(&state, kKeySpace, 0.99, 0);
+
+  std::vector<uint64_t> keys(kSamples);
+  std::unordered_map<uint64_t, uint32_t> exact;
+  for (auto &k : keys) {
+    k = mehcached_zipf_next(&state);
+    exact[k]++;
+  }
+
+  // the exact count of the last of the top candidates, ties count as hits
+  std::vector<uint32_t> counts;
+  for (auto &e : exact) {
+    counts.push_back(e.second);
+  }
+  std::nth_element(counts.begin(), counts.begin() + kCandidates - 1,
+                   counts.end(), std::greater<uint32_t>());
+  uint32_t boundary = counts[kCandidates - 1];
+
+  for (int blocked = 0; blocked < 2; ++blocked) {
+    for (int parts = 1; parts <= 2; ++parts) {
+      nap::HotSetDetector *d[2];
+      for (int p = 0; p < parts; ++p) {
+        if (blocked) {
+          d[p] = new nap::BlockedCountMin(kCandidates, false);
+        } else {
+          d[p] = new nap::CountMin(kCandidates, false);
+        }
+      }
+
+      nap::SampledAccess batch[kBatch];
+      nap::Timer timer;
+      timer.begin();
+      for (uint64_t i = 0; i < kSamples; i += kBatch) {
+        for (int j = 0; j < kBatch; ++j) {
+          batch[j] = {nap::Slice((char *)&keys[i + j], sizeof(uint64_t)), 1,
+                      0, 0};
+        }
+        d[i / kBatch % parts]->access_batch(batch, kBatch);
+      }
+      if (parts == 2) {
+        d[0]->merge(*d[1]);
+      }
+      uint64_t ns = timer.end();
+
+      auto &l = d[0]->get_list();
+      size_t hit = 0;
+      for (size_t i = 1; i < l.size(); ++i) {
+        hit += exact[*(uint64_t *)(l[i].key.c_str())] >= boundary;
+      }
+
+      printf("%s%s: %.1f ns per sample, %.1f%% of %lu candidates are top "
+             "keys\n",
+             blocked ? "blocked count-min" : "count-min",
+             parts == 2 ? " (2 sockets merged)" : "", ns * 1.0 / kSamples,
+             hit * 100.0 / std::max<size_t>(l.size() - 1, 1), l.size() - 1);
+
+      for (int p = 0; p < parts; ++p) {
+        delete d[p];
+      }
+    }
+  }
+
+  // cost of ``record`` on the worker, and how many records the shift
+  // thread then polls for the same samples
+  struct CountingDetector : public nap::HotSetDetector {
+    std::vector<nap::Node> list;
+    uint64_t records = 0, samples = 0;
+
+    std::vector<nap::Node> &get_list() override { return list; }
+    void set_candidates(int k) override {}
+    void reset() override {}
+    uint32_t query(const nap::Slice &key) override { return 0; }
+    void access(const nap::SampledAccess &a) override {
+      records++;
+      samples += a.cnt;
+    }
+    void merge(nap::HotSetDetector &other) override {}
+  };
+
+  auto *counting = new CountingDetector();
+  std::atomic<bool> done(false);
+  std::thread worker([&]() {
+    nap::Timer timer;
+    timer.begin();
+    for (auto &k : keys) {
+      counting->record(nap::Slice((char *)&k, sizeof(uint64_t)));
+    }
+    printf("record: %.1f ns per sample\n", timer.end() * 1.0 / kSamples);
+    done = true;
+  });
+  std::thread poller([&]() {
+    while (!done) {
+      counting->poll_workloads(0.1);
+    }
+    counting->poll_workloads(0.1);
+  });
+  worker.join();
+  poller.join();
+  printf("polled %lu records for %lu of %lu samples\n", counting->records,
+         counting->samples, kSamples);
+  delete counting;
+
+  // keys longer than a record, on few hot keys so that they stay folded
+  // until the reader publishes them after the worker stopped
+  constexpr uint64_t kLongSamples = 1000;
+  counting = new CountingDetector();
+  std::thread long_worker([&]() {
+    char key[200] = {};
+    for (uint64_t i = 0; i < kLongSamples; ++i) {
+      key[sizeof(key) - 1] = i % 16;
+      counting->record(nap::Slice(key, sizeof(key)));
+    }
+  });
+  long_worker.join();
+  counting->poll_workloads(0.5);
+  printf("polled %lu records for %lu of %lu long key samples\n",
+         counting->records, counting->samples, kLongSamples);
+  delete counting;
+}
+
+int main(int argc, char *argv[]) {
+
+  // ./topK_test [space_saving | blocked | bench]
+  if (argc > 1 && std::string(argv[1]) == "bench") {
+    bench_sketches();
+    return 0;
+  }
+
+  if (argc > 1 && std::string(argv[1]) == "space_saving") {
+    CM = new nap::SpaceSaving(100000);
+  } else if (argc > 1 && std::string(argv[1]) == "blocked") {
+    CM = new nap::BlockedCountMin(100000);
+  } else {
+    CM = new nap::CountMin(100000);
+  }
 
   for (int i = 0; i < kAccessThread; ++i) {
     new std::thread(access_thread, i);